@@ -412,10 +412,11 @@ static int nvm_create_tgt(struct nvm_dev *dev, struct nvm_ioctl_create *create)
 	tdisk->private_data = targetdata;
 	tqueue->queuedata = targetdata;
 
-	//bookmark: adjust bio max sectors
-	//blk_queue_max_hw_sectors(tqueue, (dev->geo.csecs >> 9) * NVM_MAX_VLBA);
-	blk_queue_max_hw_sectors(tqueue, 8*8);
-	printk("ocssd[%s] queue_max_sectors=%d\n", __func__, 8*8);
+	/* Targets take large bios whole and fan them out into vector
+	 * commands themselves
+	 */
+	blk_queue_max_hw_sectors(tqueue, NVM_TGT_MAX_IO >> 9);
+	printk("ocssd[%s] queue_max_sectors=%d\n", __func__, NVM_TGT_MAX_IO >> 9);
 
 	set_capacity(tdisk, tt->capacity(targetdata));
 	printk("ocssd[%s] set_capacity=%ld\n", __func__, tt->capacity(targetdata));
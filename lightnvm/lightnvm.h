@@ -279,6 +279,8 @@ struct nvm_target {
 #define NVM_VERSION_PATCH 0
 
 #define NVM_MAX_VLBA (64) /* max logical blocks in a vector command */
+#define NVM_TGT_MAX_IO (1 << 20) /* max bio size a target accepts whole */
+#define NVM_RQ_CMD_SIZE (64) /* room for a device command in nvm_rq */
 
 struct nvm_rq;
 typedef void (nvm_end_io_fn)(struct nvm_rq *);
@@ -308,6 +310,8 @@ struct nvm_rq {
 	u64 ppa_status; /* TODO: ppa media status,现在不支持返回ppa读写状态 */
 	int error;
 
+	void *cmd; /* optional NVM_RQ_CMD_SIZE buffer owned by the target */
+
 	void *private;
 };
 
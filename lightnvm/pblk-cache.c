@@ -16,6 +16,200 @@
  */
 
 #include "pblk.h"
+#include <linux/hash.h>
+
+/* Halve all counters, eight at a time. Racing updates may be lost */
+static void pblk_class_decay_ws(struct work_struct *work)
+{
+	struct pblk_class *cls = container_of(work, struct pblk_class,
+								decay_ws);
+	u64 *cnt = (u64 *)cls->cnt;
+	unsigned long i;
+
+	for (i = 0; i < (1UL << cls->cnt_bits) / sizeof(u64); i++)
+		cnt[i] = (cnt[i] >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+}
+
+int pblk_class_init(struct pblk *pblk)
+{
+	struct pblk_class *cls = &pblk->cls;
+	u64 nr_ranges = pblk->rl.nr_secs >> PBLK_CLASS_RANGE_SHIFT;
+	int i;
+
+	/* About eight ranges per counter, within 4KB and 1MB */
+	cls->cnt_bits = clamp(ilog2(max_t(u64, nr_ranges >> 3, 1)), 12, 20);
+	cls->cnt = vzalloc(1UL << cls->cnt_bits);
+	if (!cls->cnt)
+		return -ENOMEM;
+
+	cls->hot_thrs = PBLK_CLASS_HOT_THRS;
+	atomic_set(&cls->updates, 0);
+	INIT_WORK(&cls->decay_ws, pblk_class_decay_ws);
+	atomic_set(&cls->seq_next, 0);
+	for (i = 0; i < PBLK_CLASS_NR_SEQ; i++)
+		cls->seq_end[i] = ADDR_EMPTY;
+	for (i = 0; i < PBLK_NR_CLASSES; i++)
+		atomic64_set(&cls->secs[i], 0);
+
+	return 0;
+}
+
+void pblk_class_free(struct pblk *pblk)
+{
+	cancel_work_sync(&pblk->cls.decay_ws);
+	vfree(pblk->cls.cnt);
+}
+
+/*
+ * Classify a write of @nr_secs at @lba. A write that continues one of the last
+ * few, or spans a whole stripe, is sequential. It is not counted as an update,
+ * since it writes each range once. Other writes are hot when their range was
+ * updated often enough lately.
+ */
+static unsigned int pblk_class_write(struct pblk *pblk, sector_t lba,
+				     int nr_secs)
+{
+	struct pblk_class *cls = &pblk->cls;
+	unsigned int thrs = READ_ONCE(cls->hot_thrs);
+	u64 range = lba >> PBLK_CLASS_RANGE_SHIFT;
+	unsigned int class = PBLK_CLASS_COLD;
+	u8 *c1, *c2;
+	u8 heat;
+	int i;
+
+	if (!thrs)
+		return PBLK_CLASS_COLD;
+
+	for (i = 0; i < PBLK_CLASS_NR_SEQ; i++) {
+		if (READ_ONCE(cls->seq_end[i]) == lba) {
+			WRITE_ONCE(cls->seq_end[i], lba + nr_secs);
+			class = PBLK_CLASS_SEQ;
+			goto out;
+		}
+	}
+
+	i = (unsigned int)atomic_inc_return(&cls->seq_next) % PBLK_CLASS_NR_SEQ;
+	WRITE_ONCE(cls->seq_end[i], lba + nr_secs);
+
+	if (nr_secs >= pblk->max_write_pgs) {
+		class = PBLK_CLASS_SEQ;
+		goto out;
+	}
+
+	/* Conservative update: only the smallest counters grow */
+	c1 = &cls->cnt[hash_64(range, cls->cnt_bits)];
+	c2 = &cls->cnt[hash_64(~range, cls->cnt_bits)];
+	heat = min(READ_ONCE(*c1), READ_ONCE(*c2));
+	if (heat < U8_MAX) {
+		if (READ_ONCE(*c1) == heat)
+			WRITE_ONCE(*c1, heat + 1);
+		if (READ_ONCE(*c2) == heat)
+			WRITE_ONCE(*c2, heat + 1);
+	}
+
+	/* Decaying walks all counters; keep it off the submission path */
+	if (!(atomic_inc_return(&cls->updates) & ((1U << cls->cnt_bits) - 1)))
+		schedule_work(&cls->decay_ws);
+
+	if (heat >= thrs)
+		class = PBLK_CLASS_HOT;
+
+out:
+	atomic64_add(nr_secs, &cls->secs[class]);
+	return class;
+}
+
+static bool pblk_write_is_sync(struct bio *bio)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+	return bio->bi_rw & (REQ_SYNC | REQ_FUA | REQ_FLUSH);
+#else
+	return bio->bi_opf & (REQ_SYNC | REQ_FUA | REQ_PREFLUSH);
+#endif
+}
+
+/* GC'd sectors survived a whole line. The last stream is kept for them */
+static unsigned int pblk_gc_stream(struct pblk *pblk)
+{
+	return READ_ONCE(pblk->nr_streams) - 1;
+}
+
+/*
+ * Small synchronous writes go to the SLC stream, where the write unit is a
+ * third of the TLC one: the writer waits on them, and they are likely to be
+ * padded. Write lifetime hints pick the stream for the rest. Longer lived
+ * data goes to higher streams, below the GC one. Sectors without a hint go to
+ * the stream of their class. With a single stream, they all go to the data
+ * line.
+ */
+static unsigned int pblk_write_stream(struct pblk *pblk, struct bio *bio,
+				      sector_t lba, int nr_secs)
+{
+	unsigned int nr_streams = READ_ONCE(pblk->nr_streams);
+	unsigned int last;
+
+	if (nr_secs < READ_ONCE(pblk->slc_place_secs) &&
+						pblk_write_is_sync(bio))
+		return PBLK_STREAM_SLC;
+
+	if (nr_streams <= 2)
+		return 0;
+
+	last = pblk_gc_stream(pblk) - 1;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	if (bio->bi_write_hint > WRITE_LIFE_NONE)
+		return min_t(unsigned int, bio->bi_write_hint - WRITE_LIFE_NONE,
+									last);
+#endif
+	if (!READ_ONCE(pblk->cls.hot_thrs))
+		return 0;
+
+	return min(pblk_class_write(pblk, lba, nr_secs), last);
+}
+
+/*
+ * Large bios made of whole, page-aligned sectors can be stored on the write
+ * buffer by reference. Small or unaligned bios are cheaper to copy, since the
+ * user bio can then be completed right away.
+ */
+static bool pblk_write_zc_allowed(struct pblk *pblk, struct bio *bio,
+				  int nr_entries)
+{
+	unsigned int zc_min_secs = READ_ONCE(pblk->zc_min_secs);
+	struct bio_vec bv;
+	struct bvec_iter iter;
+
+	if (!zc_min_secs || nr_entries < zc_min_secs)
+		return false;
+
+	bio_for_each_segment(bv, bio, iter) {
+		if (bv.bv_offset || bv.bv_len != PBLK_EXPOSED_PAGE_SIZE ||
+						PageHighMem(bv.bv_page))
+			return false;
+	}
+
+	return true;
+}
+
+static void pblk_write_entries_zc(struct pblk *pblk, struct bio *bio,
+				  struct pblk_w_ctx w_ctx, sector_t lba,
+				  unsigned int bpos)
+{
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	unsigned int pos;
+	int i = 0;
+
+	bio_for_each_segment(bv, bio, iter) {
+		w_ctx.lba = lba + i;
+
+		pos = pblk_rb_wrap_pos(&pblk->rwb, bpos + i);
+		pblk_rb_write_entry_zc(&pblk->rwb, page_address(bv.bv_page),
+								w_ctx, pos);
+		i++;
+	}
+}
 
 int pblk_write_to_cache(struct pblk *pblk, struct bio *bio, unsigned long flags)
 {
@@ -26,7 +220,9 @@ int pblk_write_to_cache(struct pblk *pblk, struct bio *bio, unsigned long flags)
 	sector_t lba = pblk_get_lba(bio);
 	unsigned long start_time = jiffies;
 	unsigned int bpos, pos;
+	unsigned int event;
 	int nr_entries = pblk_get_secs(bio);
+	bool zero_copy;
 	int i, ret;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
@@ -35,15 +231,19 @@ int pblk_write_to_cache(struct pblk *pblk, struct bio *bio, unsigned long flags)
 	generic_start_io_acct(q, WRITE, bio_sectors(bio), &pblk->disk->part0);
 #endif
 
+	zero_copy = bio_has_data(bio) &&
+			pblk_write_zc_allowed(pblk, bio, nr_entries);
+
 	/* bookmark: Update the write buffer head (mem) with the entries that we can
 	 * write. The write in itself cannot fail, so there is no need to
 	 * rollback from here on.
 	 */
 retry:
+	event = pblk_rb_space_event(&pblk->rwb);
 	ret = pblk_rb_may_write_user(&pblk->rwb, bio, nr_entries, &bpos);
 	switch (ret) {
 	case NVM_IO_REQUEUE:
-		io_schedule();
+		pblk_rb_wait_space(&pblk->rwb, event);
 		goto retry;
 	case NVM_IO_ERR:
 		pblk_pipeline_stop(pblk);
@@ -52,6 +252,7 @@ retry:
 
 	pblk_ppa_set_empty(&w_ctx.ppa);
 	w_ctx.flags = flags;
+	w_ctx.stream = 0;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
 	if (bio->bi_rw & REQ_FLUSH)
 #else
@@ -65,6 +266,24 @@ retry:
 	if (unlikely(!bio_has_data(bio)))
 		goto out;
 
+	w_ctx.stream = pblk_write_stream(pblk, bio, lba, nr_entries);
+
+	if (zero_copy) {
+		/* The bio completes when its last entry is persisted. A flush
+		 * has already been queued on that same entry
+		 */
+		if (ret != NVM_IO_OK)
+			pblk_rb_hold_bio(&pblk->rwb, bio,
+				pblk_rb_wrap_pos(&pblk->rwb, bpos + nr_entries - 1));
+		ret = NVM_IO_OK;
+
+		pblk_write_entries_zc(pblk, bio, w_ctx, lba, bpos);
+#ifdef CONFIG_NVM_DEBUG
+		atomic_long_add(nr_entries, &pblk->zc_writes);
+#endif
+		goto account;
+	}
+
 	for (i = 0; i < nr_entries; i++) {
 		void *data = bio_data(bio);
 		w_ctx.lba = lba + i;
@@ -76,7 +295,9 @@ retry:
 		bio_advance(bio, PBLK_EXPOSED_PAGE_SIZE);
 	}
 
+account:
 	atomic64_add(nr_entries, &pblk->user_wa);
+	atomic64_add(nr_entries, &pblk->stream_user[w_ctx.stream]);
 
 #ifdef CONFIG_NVM_DEBUG
 	atomic_long_add(nr_entries, &pblk->inflight_writes);
@@ -95,6 +316,29 @@ out:
 	return ret;
 }
 
+static void pblk_write_gc_entries(struct pblk *pblk, struct pblk_gc_rq *gc_rq,
+				  unsigned int bpos, unsigned int stream)
+{
+	struct pblk_w_ctx w_ctx;
+	unsigned int valid_entries;
+
+	w_ctx.flags = PBLK_IOTYPE_GC;
+	w_ctx.stream = stream;
+	pblk_ppa_set_empty(&w_ctx.ppa);
+
+	valid_entries = pblk_rb_write_entries_gc(&pblk->rwb, gc_rq, w_ctx, bpos);
+
+	WARN_ONCE(gc_rq->secs_to_gc != valid_entries, "pblk: inconsistent GC write\n");
+
+	atomic64_add(valid_entries, &pblk->gc_wa);
+	atomic64_add(valid_entries, &pblk->stream_gc[stream]);
+
+#ifdef CONFIG_NVM_DEBUG
+	atomic_long_add(valid_entries, &pblk->inflight_writes);
+	atomic_long_add(valid_entries, &pblk->recov_gc_writes);
+#endif
+}
+
 /*
  * On GC the incoming lbas are not necessarily sequential. Also, some of the
  * lbas might not be valid entries, which are marked as empty by the GC thread
@@ -102,10 +346,8 @@ out:
 //bookmark: when use SLC cache, gc write TLC first.
 int pblk_write_gc_to_cache(struct pblk *pblk, struct pblk_gc_rq *gc_rq)
 {
-	struct pblk_w_ctx w_ctx;
-	unsigned int bpos, pos;
-	void *data;
-	int i, valid_entries;
+	unsigned int bpos;
+	unsigned int event;
 
 	/* Update the write buffer head (mem) with the entries that we can
 	 * write. The write in itself cannot fail, so there is no need to
@@ -113,38 +355,32 @@ int pblk_write_gc_to_cache(struct pblk *pblk, struct pblk_gc_rq *gc_rq)
 	 */
 retry:
 	//printk("ocssd[%s]: secs_to_gc=%d, nr_entries=%d, line_id=%d\n", __func__, gc_rq->secs_to_gc, gc_rq->nr_secs, gc_rq->line->id);
+	event = pblk_rb_space_event(&pblk->rwb);
 	if (!pblk_rb_may_write_gc(&pblk->rwb, gc_rq->secs_to_gc, &bpos)) {
-		io_schedule();
+		pblk_rb_wait_space(&pblk->rwb, event);
 		goto retry;
 	}
 
-	w_ctx.flags = PBLK_IOTYPE_GC;
-	pblk_ppa_set_empty(&w_ctx.ppa);
-
-	for (i = 0, valid_entries = 0; i < gc_rq->nr_secs; i++) {
-		if (gc_rq->lba_list[i] == ADDR_EMPTY)
-			continue;
-
-		w_ctx.lba = gc_rq->lba_list[i];
-
-		pos = pblk_rb_wrap_pos(&pblk->rwb, bpos + valid_entries);
-
-		data = gc_rq->data+i*PAGE_SIZE;
-		pblk_rb_write_entry_gc(&pblk->rwb, data, w_ctx, gc_rq->line,
-						gc_rq->paddr_list[i], pos);
+	pblk_write_gc_entries(pblk, gc_rq, bpos, pblk_gc_stream(pblk));
 
-		valid_entries++;
-	}
+	pblk_write_should_kick(pblk);
+	return NVM_IO_OK;
+}
 
-	WARN_ONCE(gc_rq->secs_to_gc != valid_entries, "pblk: inconsistent GC write\n");
+/*
+ * Same as pblk_write_gc_to_cache(), from the write thread, which is about to
+ * pad a write unit. The sectors go to the stream being written so that they
+ * take the place of the padding. The write thread is the one freeing buffer
+ * space, so it never waits for it.
+ */
+int pblk_write_gc_to_pad(struct pblk *pblk, struct pblk_gc_rq *gc_rq)
+{
+	unsigned int bpos;
 
-	atomic64_add(valid_entries, &pblk->gc_wa);
+	if (!pblk_rb_may_write_gc(&pblk->rwb, gc_rq->secs_to_gc, &bpos))
+		return NVM_IO_REQUEUE;
 
-#ifdef CONFIG_NVM_DEBUG
-	atomic_long_add(valid_entries, &pblk->inflight_writes);
-	atomic_long_add(valid_entries, &pblk->recov_gc_writes);
-#endif
+	pblk_write_gc_entries(pblk, gc_rq, bpos, pblk->l_mg.w_stream);
 
-	pblk_write_should_kick(pblk);
 	return NVM_IO_OK;
 }
@@ -239,6 +239,8 @@ static void pblk_invalidate_range(struct pblk *pblk, sector_t slba,
 		pblk_trans_map_set(pblk, lba, ppa);
 	}
 	spin_unlock(&pblk->trans_lock);
+
+	pblk_rcache_invalidate(pblk, slba, nr_secs);
 }
 
 /* Caller must guarantee that the request is a valid type */
@@ -400,7 +402,14 @@ void pblk_write_timer_fn(struct timer_list *t)
 void pblk_write_should_kick(struct pblk *pblk)
 {
 	unsigned int secs_avail = pblk_rb_read_count(&pblk->rwb);
-	int min_write_pgs = pblk_get_min_write_pgs(pblk);
+	int min_write_pgs = pblk_stream_min_write_pgs(pblk, 0);
+	unsigned int target = READ_ONCE(pblk->batch_target);
+
+	/* While the write thread waits for a full stripe, only wake it up
+	 * once the stripe is there
+	 */
+	if (target > min_write_pgs)
+		min_write_pgs = target;
 
 	//printk("ocssd[%s]: rwb_secs_avail=%d, min_write_pgs=%d\n", __func__, secs_avail, min_write_pgs);
 	if (secs_avail >= min_write_pgs) {
@@ -617,13 +626,22 @@ out:
 
 void pblk_set_sec_per_write(struct pblk *pblk, int sec_per_write)
 {
-	pblk->sec_per_write = sec_per_write;
+	/* Stripes are made of whole write units */
+	sec_per_write -= sec_per_write % pblk->min_write_pgs;
+	if (sec_per_write < pblk->min_write_pgs)
+		sec_per_write = pblk->min_write_pgs;
+
+	WRITE_ONCE(pblk->sec_per_write, sec_per_write);
 }
 
+/*
+ * SLC writes can sit in the device cache, and there is no flush command to
+ * push them out later, so every one of them is written with FUA
+ */
 int pblk_submit_io(struct pblk *pblk, struct nvm_rq *rqd)
 {
 	struct nvm_tgt_dev *dev = pblk->dev;
-	union oc_io_flag flags;
+	union oc_io_flag flags = { .flag = 0 };
 	int line_id;
 
 	if(rqd->nr_ppas == 1)
@@ -724,13 +742,26 @@ out:
 	return bio;
 }
 
-int pblk_calc_secs(struct pblk *pblk, unsigned long secs_avail, unsigned long secs_to_flush)
+/*
+ * A write request is a stripe of minimum write units, each one on a different
+ * LUN, of up to sec_per_write sectors. SLC lines store a third of the sectors
+ * on each unit, so the stripe shrinks accordingly. The stripe is always made of
+ * whole units, since pblk_map_rq() maps a full unit at a time.
+ */
+int pblk_calc_secs(struct pblk *pblk, struct pblk_line *line,
+		   unsigned long secs_avail, unsigned long secs_to_flush)
 {
-	//int max = pblk->sec_per_write;
-	int max = pblk_get_min_write_pgs(pblk);
-	int min = pblk_get_min_write_pgs(pblk);
+	int min = line_get_min_write_pgs(line);
+	int max = min_t(int, READ_ONCE(pblk->sec_per_write),
+						pblk->max_write_pgs);
 	int secs_to_sync = 0;
 
+	if (min != pblk->min_write_pgs)
+		max /= NAND_TLC_STEP;
+	max -= max % min;
+	if (max < min)
+		max = min;
+
 	if (secs_avail >= max)
 		secs_to_sync = max;
 	else if (secs_avail >= min)
@@ -1532,6 +1563,7 @@ static int pblk_line_prepare(struct pblk *pblk, struct pblk_line *line)
 	}
 
 	line->state = PBLK_LINESTATE_OPEN;
+	line->stream = 0;
 
 	atomic_set(&line->left_eblks, blk_to_erase);
 	atomic_set(&line->left_seblks, blk_to_erase);
@@ -1601,6 +1633,32 @@ void pblk_line_free(struct pblk_line *line)
 	pblk_line_reinit(line);
 }
 
+/*
+ * Free SLC lines come first. With SLC placement on, the SLC stream only takes
+ * SLC lines and the other streams take TLC lines while there are any, so that
+ * large writes are not folded later.
+ */
+static struct pblk_line *pblk_line_first_free(struct pblk *pblk)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	bool slc = (l_mg->w_stream == PBLK_STREAM_SLC);
+	struct pblk_line *line;
+
+	if (!slc && !READ_ONCE(pblk->slc_place_secs))
+		return list_first_entry(&l_mg->free_list, struct pblk_line,
+									list);
+
+	list_for_each_entry(line, &l_mg->free_list, list) {
+		if (line_is_slc(line) == slc)
+			return line;
+	}
+
+	if (slc)
+		return NULL;
+
+	return list_first_entry(&l_mg->free_list, struct pblk_line, list);
+}
+
 //bookmark: 决定下一个line是哪个
 struct pblk_line *pblk_line_get(struct pblk *pblk)
 {
@@ -1618,7 +1676,10 @@ retry:
 	}
 
 	//bookmark: 从free_list中获取空闲的line
-	line = list_first_entry(&l_mg->free_list, struct pblk_line, list);
+	line = pblk_line_first_free(pblk);
+	if (!line)
+		return NULL;
+
 	list_del(&line->list);
 	l_mg->nr_free_lines--;
 
@@ -1655,10 +1716,18 @@ retry:
 	return line;
 }
 
+static struct pblk_line **pblk_stream_slot(struct pblk_line_mgmt *l_mg,
+					   unsigned int stream)
+{
+	return (stream) ? &l_mg->stream_line[stream] : &l_mg->data_line;
+}
+
+/* Replace the open line of the stream being mapped by the write thread */
 static struct pblk_line *pblk_line_retry(struct pblk *pblk,
 					 struct pblk_line *line)
 {
 	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_line **slot = pblk_stream_slot(l_mg, l_mg->w_stream);
 	struct pblk_line *retry_line;
 
 	printk("ocssd[%s]: \n", __func__);
@@ -1666,11 +1735,15 @@ retry:
 	spin_lock(&l_mg->free_lock);
 	retry_line = pblk_line_get(pblk);
 	if (!retry_line) {
-		l_mg->data_line = NULL;
+		*slot = NULL;
 		spin_unlock(&l_mg->free_lock);
 		return NULL;
 	}
 
+	/* Take over the sequence number, which orders lines on recovery */
+	retry_line->seq_nr = line->seq_nr;
+	retry_line->type = line->type;
+	retry_line->stream = line->stream;
 	retry_line->map_bitmap = line->map_bitmap;
 	retry_line->invalid_bitmap = line->invalid_bitmap;
 	retry_line->smeta = line->smeta;
@@ -1679,7 +1752,7 @@ retry:
 
 	pblk_line_reinit(line);
 
-	l_mg->data_line = retry_line;
+	*slot = retry_line;
 	spin_unlock(&l_mg->free_lock);
 
 	pblk_rl_free_lines_dec(&pblk->rl, line, false);
@@ -1771,7 +1844,7 @@ static void pblk_stop_writes(struct pblk *pblk, struct pblk_line *line)
 	pblk->state = PBLK_STATE_STOPPING;
 }
 
-static void pblk_line_close_meta_sync(struct pblk *pblk)
+void pblk_line_close_meta_sync(struct pblk *pblk)
 {
 	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
 	struct pblk_line_meta *lm = &pblk->lm;
@@ -1827,6 +1900,7 @@ void __pblk_pipeline_flush(struct pblk *pblk)
 	spin_unlock(&l_mg->free_lock);
 
 	pblk_flush_writer(pblk);
+	flush_workqueue(pblk->w_sub_wq);
 	pblk_wait_for_meta(pblk);
 
 	ret = pblk_recov_pad(pblk);
@@ -1847,6 +1921,9 @@ void __pblk_pipeline_stop(struct pblk *pblk)
 	pblk->state = PBLK_STATE_STOPPED;
 	l_mg->data_line = NULL;
 	l_mg->data_next = NULL;
+	memset(l_mg->stream_line, 0, sizeof(l_mg->stream_line));
+	memset(l_mg->stream_next, 0, sizeof(l_mg->stream_next));
+	l_mg->w_stream = 0;
 	spin_unlock(&l_mg->free_lock);
 }
 
@@ -1857,6 +1934,111 @@ void pblk_pipeline_stop(struct pblk *pblk)
 	__pblk_pipeline_stop(pblk);
 }
 
+static void pblk_line_erase_ws(struct work_struct *work)
+{
+	struct pblk_line_ws *line_ws = container_of(work, struct pblk_line_ws,
+									ws);
+	struct pblk *pblk = line_ws->pblk;
+	struct pblk_line *line = line_ws->line;
+
+	/* A block that fails to erase is marked bad; go on with the others so
+	 * that left_seblks always drops to zero
+	 */
+	while (atomic_read(&line->left_eblks) && pblk_line_erase(pblk, line))
+		;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+	mempool_free(line_ws, pblk->gen_ws_pool);
+#else
+	mempool_free(line_ws, &pblk->gen_ws_pool);
+#endif
+}
+
+/* Take the next line of @stream off the free list and erase it in background */
+static void pblk_line_prepare_stream(struct pblk *pblk, unsigned int stream)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_line *next;
+
+	spin_lock(&l_mg->free_lock);
+	if (l_mg->stream_next[stream]) {
+		spin_unlock(&l_mg->free_lock);
+		return;
+	}
+
+	next = pblk_line_get(pblk);
+	l_mg->stream_next[stream] = next;
+	spin_unlock(&l_mg->free_lock);
+
+	if (next)
+		pblk_gen_run_ws(pblk, next, NULL, pblk_line_erase_ws,
+						GFP_KERNEL, pblk->bb_wq);
+}
+
+/*
+ * Streams other than the first one open the line erased in background by
+ * pblk_line_prepare_stream. If it is not ready, the stream is left without a
+ * line and the caller maps the request elsewhere instead of waiting for the
+ * erase. The new line gets the highest sequence number of all open lines,
+ * which pblk_write_stream_fits relies on.
+ */
+static struct pblk_line *pblk_line_replace_stream(struct pblk *pblk)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	unsigned int stream = l_mg->w_stream;
+	struct pblk_line *cur, *new;
+
+	spin_lock(&l_mg->free_lock);
+	cur = l_mg->stream_line[stream];
+	l_mg->stream_line[stream] = NULL;
+	new = l_mg->stream_next[stream];
+	spin_unlock(&l_mg->free_lock);
+
+	if (!new || atomic_read(&new->left_seblks))
+		goto out;
+
+	/* On failure the line stays prepared for the next attempt */
+	if (pblk_line_alloc_bitmaps(pblk, new)) {
+		new = NULL;
+		goto out;
+	}
+
+	spin_lock(&l_mg->free_lock);
+	l_mg->stream_next[stream] = NULL;
+	l_mg->stream_line[stream] = new;
+
+	new->seq_nr = l_mg->d_seq_nr++;
+	new->type = PBLK_LINETYPE_DATA;
+	new->stream = stream;
+
+	pblk_line_setup_metadata(new, l_mg, &pblk->lm);
+	spin_unlock(&l_mg->free_lock);
+
+retry_setup:
+	if (!pblk_line_init_metadata(pblk, new, cur)) {
+		new = pblk_line_retry(pblk, new);
+		if (!new)
+			goto out;
+
+		goto retry_setup;
+	}
+
+	if (!pblk_line_init_bb(pblk, new, 1)) {
+		new = pblk_line_retry(pblk, new);
+		if (!new)
+			goto out;
+
+		goto retry_setup;
+	}
+
+	pblk_rl_free_lines_dec(&pblk->rl, new, true);
+	atomic64_inc(&pblk->stream_lines[stream]);
+
+out:
+	pblk_line_prepare_stream(pblk, stream);
+	return new;
+}
+
 //bookmark: 为下一line分配资源
 struct pblk_line *pblk_line_replace_data(struct pblk *pblk)
 {
@@ -1864,6 +2046,9 @@ struct pblk_line *pblk_line_replace_data(struct pblk *pblk)
 	struct pblk_line *cur, *new = NULL;
 	unsigned int left_seblks;
 
+	if (l_mg->w_stream)
+		return pblk_line_replace_stream(pblk);
+
 	new = l_mg->data_next;
 	if (!new) {
 		printk("ocssd[%s]: data_next=NULL\n", __func__);
@@ -2092,9 +2277,19 @@ int pblk_blk_erase_async(struct pblk *pblk, struct ppa_addr ppa)
 	return err;
 }
 
+/*
+ * Open line of the stream being mapped by the write thread. l_mg->w_stream is
+ * private to the write thread; other callers name the stream they want through
+ * pblk_stream_line()
+ */
 struct pblk_line *pblk_line_get_data(struct pblk *pblk)
 {
-	return pblk->l_mg.data_line;
+	return pblk_stream_line(pblk, pblk->l_mg.w_stream);
+}
+
+struct pblk_line *pblk_stream_line(struct pblk *pblk, unsigned int stream)
+{
+	return READ_ONCE(*pblk_stream_slot(&pblk->l_mg, stream));
 }
 
 /* For now, always erase next line */
@@ -2262,15 +2457,45 @@ void pblk_gen_run_ws(struct pblk *pblk, struct pblk_line *line, void *priv,
 	queue_work(wq, &line_ws->ws);
 }
 
-static void __pblk_down_page(struct pblk *pblk, struct ppa_addr *ppa_list,
-			     int nr_ppas, int pos)
+static unsigned int pblk_lun_ticket(struct pblk_lun *rlun)
+{
+	return (unsigned int)atomic_inc_return(&rlun->map_seq) - 1;
+}
+
+static void pblk_lun_wait_turn(struct pblk_lun *rlun, unsigned int seq)
+{
+	wait_event(rlun->seq_wait, READ_ONCE(rlun->sub_seq) == seq);
+}
+
+/* Take wr_sem on our turn, and hand the turn to the next ticket */
+static void pblk_lun_down(struct pblk_lun *rlun, unsigned int seq)
 {
-	struct pblk_lun *rlun = &pblk->luns[pos];
 	int ret;
 
+	ret = down_timeout(&rlun->wr_sem, msecs_to_jiffies(30000));
+	if (ret == -ETIME || ret == -EINTR)
+		pr_err("pblk: taking lun semaphore timed out: err %d\n", -ret);
+
+	WRITE_ONCE(rlun->sub_seq, seq + 1);
+	wake_up_all(&rlun->seq_wait);
+}
+
+/*
+ * Lock the LUN of a single page write, e.g., metadata or padding. It takes a
+ * ticket like mapped requests do, so that it does not take wr_sem out of turn.
+ */
+void pblk_down_page(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas)
+{
+	struct nvm_tgt_dev *dev = pblk->dev;
+	struct nvm_geo *geo = &dev->geo;
+	int pos = pblk_ppa_to_pos(geo, ppa_list[0]);
+	struct pblk_lun *rlun = &pblk->luns[pos];
+	unsigned int seq;
+
 	/*
 	 * Only send one inflight I/O per LUN. Since we map at a page
-	 * granurality, all ppas in the I/O will map to the same LUN
+	 * granurality, all ppas in a minimum write unit map to the same LUN.
+	 * Striped requests lock each LUN in the stripe once (see pblk_down_rq)
 	 */
 #ifdef CONFIG_NVM_DEBUG
 	int i;
@@ -2281,34 +2506,48 @@ static void __pblk_down_page(struct pblk *pblk, struct ppa_addr *ppa_list,
 	}
 #endif
 
-	ret = down_timeout(&rlun->wr_sem, msecs_to_jiffies(30000));
-	if (ret == -ETIME || ret == -EINTR)
-		pr_err("pblk: taking lun semaphore timed out: err %d\n", -ret);
+	seq = pblk_lun_ticket(rlun);
+	pblk_lun_wait_turn(rlun, seq);
+	pblk_lun_down(rlun, seq);
 }
 
-void pblk_down_page(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas)
+/*
+ * Hand out a ticket on each LUN of a mapped write request. Only the write
+ * thread maps requests, so tickets follow the order of the pages on each LUN.
+ */
+void pblk_seq_rq(struct pblk *pblk, unsigned long *lun_bitmap,
+		 unsigned int *lun_seq)
 {
 	struct nvm_tgt_dev *dev = pblk->dev;
 	struct nvm_geo *geo = &dev->geo;
-	int pos = pblk_ppa_to_pos(geo, ppa_list[0]);
+	int num_lun = geo->all_luns;
+	int bit = -1;
 
-	__pblk_down_page(pblk, ppa_list, nr_ppas, pos);
+	while ((bit = find_next_bit(lun_bitmap, num_lun, bit + 1)) < num_lun)
+		lun_seq[bit] = pblk_lun_ticket(&pblk->luns[bit]);
 }
 
-void pblk_down_rq(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas,
-		  unsigned long *lun_bitmap)
+/*
+ * Lock the LUNs of a write request. Requests are submitted concurrently, so
+ * each LUN is only taken once the requests with an earlier ticket on it have
+ * taken it. The turn on every LUN is waited for before any wr_sem is taken:
+ * a request holding a turn only waits on earlier tickets, which never wait on
+ * it, and no LUN is held busy while waiting for the turn on another one.
+ */
+void pblk_down_rq(struct pblk *pblk, unsigned long *lun_bitmap,
+		  unsigned int *lun_seq)
 {
 	struct nvm_tgt_dev *dev = pblk->dev;
 	struct nvm_geo *geo = &dev->geo;
-	int pos = pblk_ppa_to_pos(geo, ppa_list[0]);
+	int num_lun = geo->all_luns;
+	int bit = -1;
 
-	/* If the LUN has been locked for this same request, do no attempt to
-	 * lock it again
-	 */
-	if (test_and_set_bit(pos, lun_bitmap))
-		return;
+	while ((bit = find_next_bit(lun_bitmap, num_lun, bit + 1)) < num_lun)
+		pblk_lun_wait_turn(&pblk->luns[bit], lun_seq[bit]);
 
-	__pblk_down_page(pblk, ppa_list, nr_ppas, pos);
+	bit = -1;
+	while ((bit = find_next_bit(lun_bitmap, num_lun, bit + 1)) < num_lun)
+		pblk_lun_down(&pblk->luns[bit], lun_seq[bit]);
 }
 
 void pblk_up_page(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas)
@@ -2345,16 +2584,11 @@ void pblk_up_rq(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas,
 	}
 }
 
-void pblk_update_map(struct pblk *pblk, sector_t lba, struct ppa_addr ppa)
+static struct ppa_addr __pblk_update_map(struct pblk *pblk, sector_t lba,
+					 struct ppa_addr ppa)
 {
 	struct ppa_addr ppa_l2p;
 
-	/* logic error: lba out-of-bounds. Ignore update */
-	if (!(lba < pblk->rl.nr_secs)) {
-		WARN(1, "pblk: corrupted L2P map request\n");
-		return;
-	}
-
 	spin_lock(&pblk->trans_lock);
 	ppa_l2p = pblk_trans_map_get(pblk, lba);
 
@@ -2365,10 +2599,33 @@ void pblk_update_map(struct pblk *pblk, sector_t lba, struct ppa_addr ppa)
 
 	pblk_trans_map_set(pblk, lba, ppa);
 	spin_unlock(&pblk->trans_lock);
+
+	pblk_rcache_invalidate(pblk, lba, 1);
+
+	return ppa_l2p;
 }
 
-void pblk_update_map_cache(struct pblk *pblk, sector_t lba, struct ppa_addr ppa)
+void pblk_update_map(struct pblk *pblk, sector_t lba, struct ppa_addr ppa)
 {
+	/* logic error: lba out-of-bounds. Ignore update */
+	if (!(lba < pblk->rl.nr_secs)) {
+		WARN(1, "pblk: corrupted L2P map request\n");
+		return;
+	}
+
+	__pblk_update_map(pblk, lba, ppa);
+}
+
+/*
+ * Returns the lowest sequence number of the line the new copy can be written
+ * to. Recovery replays lines in sequence order, so it must not go to a line
+ * older than the one holding the previous copy.
+ */
+unsigned int pblk_update_map_cache(struct pblk *pblk, sector_t lba,
+				   struct ppa_addr ppa, unsigned int stream)
+{
+	struct pblk_line *line;
+	struct ppa_addr ppa_l2p;
 
 #ifdef CONFIG_NVM_DEBUG
 	/* Callers must ensure that the ppa points to a cache address */
@@ -2376,14 +2633,38 @@ void pblk_update_map_cache(struct pblk *pblk, sector_t lba, struct ppa_addr ppa)
 	BUG_ON(pblk_rb_pos_oob(&pblk->rwb, pblk_addr_to_cacheline(ppa)));
 #endif
 
-	pblk_update_map(pblk, lba, ppa);
+	/* logic error: lba out-of-bounds. Ignore update */
+	if (!(lba < pblk->rl.nr_secs)) {
+		WARN(1, "pblk: corrupted L2P map request\n");
+		return 0;
+	}
+
+	ppa_l2p = __pblk_update_map(pblk, lba, ppa);
+	if (pblk_ppa_empty(ppa_l2p))
+		return 0;
+
+	/* The line of the previous copy is not known until it is mapped */
+	if (pblk_addr_in_cache(ppa_l2p))
+		return PBLK_SEQ_NEWEST;
+
+	line = &pblk->lines[pblk_ppa_to_line(ppa_l2p)];
+
+	atomic64_inc(&pblk->stream_rw[stream]);
+	if (line->stream == stream)
+		atomic64_inc(&pblk->stream_rw_hit[stream]);
+
+	return line->seq_nr;
 }
 
-int pblk_update_map_gc(struct pblk *pblk, sector_t lba, struct ppa_addr ppa_new,
-		       struct pblk_line *gc_line, u64 paddr_gc)
+/*
+ * Caller holds trans_lock, and drops the read cache page of remapped lbas
+ * once it is released
+ */
+int __pblk_update_map_gc(struct pblk *pblk, sector_t lba,
+			 struct ppa_addr ppa_new, struct pblk_line *gc_line,
+			 u64 paddr_gc)
 {
 	struct ppa_addr ppa_l2p, ppa_gc;
-	int ret = 1;
 
 #ifdef CONFIG_NVM_DEBUG
 	/* Callers must ensure that the ppa points to a cache address */
@@ -2397,7 +2678,6 @@ int pblk_update_map_gc(struct pblk *pblk, sector_t lba, struct ppa_addr ppa_new,
 		return 0;
 	}
 
-	spin_lock(&pblk->trans_lock);
 	ppa_l2p = pblk_trans_map_get(pblk, lba);
 	ppa_gc = addr_to_gen_ppa(pblk, paddr_gc, gc_line->id);
 
@@ -2407,18 +2687,16 @@ int pblk_update_map_gc(struct pblk *pblk, sector_t lba, struct ppa_addr ppa_new,
 						"pblk: corrupted GC update");
 		spin_unlock(&gc_line->lock);
 
-		ret = 0;
-		goto out;
+		return 0;
 	}
 
 	pblk_trans_map_set(pblk, lba, ppa_new);
-out:
-	spin_unlock(&pblk->trans_lock);
-	return ret;
+	return 1;
 }
 
-void pblk_update_map_dev(struct pblk *pblk, sector_t lba,
-			 struct ppa_addr ppa_mapped, struct ppa_addr ppa_cache)
+/* Caller holds trans_lock */
+void __pblk_update_map_dev(struct pblk *pblk, sector_t lba,
+			   struct ppa_addr ppa_mapped, struct ppa_addr ppa_cache)
 {
 	struct ppa_addr ppa_l2p;
 
@@ -2443,7 +2721,6 @@ void pblk_update_map_dev(struct pblk *pblk, sector_t lba,
 		return;
 	}
 
-	spin_lock(&pblk->trans_lock);
 	ppa_l2p = pblk_trans_map_get(pblk, lba);
 
 	/* Do not update L2P if the cacheline has been updated. In this case,
@@ -2452,7 +2729,7 @@ void pblk_update_map_dev(struct pblk *pblk, sector_t lba,
 	if (!pblk_ppa_comp(ppa_l2p, ppa_cache)) {
 		if (!pblk_ppa_empty(ppa_mapped))
 			pblk_map_invalidate(pblk, ppa_mapped);
-		goto out;
+		return;
 	}
 
 #ifdef CONFIG_NVM_DEBUG
@@ -2460,32 +2737,52 @@ void pblk_update_map_dev(struct pblk *pblk, sector_t lba,
 #endif
 
 	pblk_trans_map_set(pblk, lba, ppa_mapped);
-out:
-	spin_unlock(&pblk->trans_lock);
 }
 
+/*
+ * Lookups do not take trans_lock. A sector on the media must not be read from
+ * a line that GC has already released, so the first reference on each line
+ * is only taken if the line is still alive, and the mapping is checked again
+ * once it is held. Further sectors on that line are then safe, and their
+ * references are added in one go.
+ */
 void pblk_lookup_l2p_seq(struct pblk *pblk, struct ppa_addr *ppas,
 			 sector_t blba, int nr_secs)
 {
+	struct pblk_line_refs refs = PBLK_LINE_REFS_INIT;
+	struct pblk_line *line;
+	struct ppa_addr ppa;
 	int i;
 
-	spin_lock(&pblk->trans_lock);
 	for (i = 0; i < nr_secs; i++) {
-		struct ppa_addr ppa;
-
-		ppa = ppas[i] = pblk_trans_map_get(pblk, blba + i);
+retry:
+		ppa = pblk_trans_map_get(pblk, blba + i);
 		//printk("ocssd[%s]: i=%d, lba=%ld, ppa=0x%08llx\n", __func__, i, blba+i, ppa.ppa);
 
-		/* If the L2P entry maps to a line, the reference is valid */
-		if (!pblk_ppa_empty(ppa) && !pblk_addr_in_cache(ppa)) {
-			int line_id = pblk_ppa_to_line(ppa);
-			struct pblk_line *line = &pblk->lines[line_id];
+		if (pblk_ppa_empty(ppa) || pblk_addr_in_cache(ppa))
+			goto next;
 
-			kref_get(&line->ref);
-			//printk("ocssd[%s]: ppa=0x%08llx, line_id=%d, kref_get=%d\n", __func__, ppa.ppa, line->id, atomic_read(&line->ref.refcount));
+		line = &pblk->lines[pblk_ppa_to_line(ppa)];
+		if (line == refs.line) {
+			pblk_line_refs_get(&refs, line);
+			goto next;
 		}
+
+		/* The line is being released, so the sector has moved */
+		if (!kref_get_unless_zero(&line->ref))
+			goto retry;
+
+		if (!pblk_ppa_comp(ppa, pblk_trans_map_get(pblk, blba + i))) {
+			kref_put(&line->ref, pblk_line_put_wq);
+			goto retry;
+		}
+
+		pblk_line_refs_get_flush(&refs);
+		refs.line = line;
+next:
+		ppas[i] = ppa;
 	}
-	spin_unlock(&pblk->trans_lock);
+	pblk_line_refs_get_flush(&refs);
 }
 
 void pblk_lookup_l2p_rand(struct pblk *pblk, struct ppa_addr *ppas,
@@ -2494,7 +2791,6 @@ void pblk_lookup_l2p_rand(struct pblk *pblk, struct ppa_addr *ppas,
 	u64 lba;
 	int i;
 
-	spin_lock(&pblk->trans_lock);
 	for (i = 0; i < nr_secs; i++) {
 		lba = lba_list[i];
 		if (lba != ADDR_EMPTY) {
@@ -2506,9 +2802,9 @@ void pblk_lookup_l2p_rand(struct pblk *pblk, struct ppa_addr *ppas,
 			ppas[i] = pblk_trans_map_get(pblk, lba);
 		}
 	}
-	spin_unlock(&pblk->trans_lock);
 }
 
+/* Write unit of the line being mapped. Write thread only */
 int pblk_get_min_write_pgs(struct pblk *pblk)
 {
 	struct pblk_line *line = pblk_line_get_data(pblk);
@@ -2520,6 +2816,14 @@ int pblk_get_min_write_pgs(struct pblk *pblk)
 	return min;
 }
 
+/* Write unit of the open line of @stream, for callers other than the writer */
+int pblk_stream_min_write_pgs(struct pblk *pblk, unsigned int stream)
+{
+	struct pblk_line *line = pblk_stream_line(pblk, stream);
+
+	return (line) ? line_get_min_write_pgs(line) : pblk->min_write_pgs;
+}
+
 int line_get_min_write_pgs(struct pblk_line *line)
 {
 	struct pblk *pblk = line->pblk;
@@ -52,6 +52,48 @@ static int pblk_gc_write(struct pblk *pblk)
 	return 0;
 }
 
+/*
+ * Called by the write thread before it pads a write unit. Queued GC requests
+ * are written to the buffer right away so that their sectors are programmed
+ * instead of the padding. Returns the number of sectors added.
+ */
+unsigned int pblk_gc_fill_pad(struct pblk *pblk, unsigned int nr_secs)
+{
+	struct pblk_gc *gc = &pblk->gc;
+	struct pblk_gc_rq *gc_rq;
+	unsigned int added = 0;
+
+	while (added < nr_secs) {
+		spin_lock(&gc->w_lock);
+		if (list_empty(&gc->w_list)) {
+			spin_unlock(&gc->w_lock);
+			break;
+		}
+		gc_rq = list_first_entry(&gc->w_list, struct pblk_gc_rq, list);
+		list_del(&gc_rq->list);
+		gc->w_entries--;
+		spin_unlock(&gc->w_lock);
+
+		if (pblk_write_gc_to_pad(pblk, gc_rq) != NVM_IO_OK) {
+			spin_lock(&gc->w_lock);
+			list_add(&gc_rq->list, &gc->w_list);
+			gc->w_entries++;
+			spin_unlock(&gc->w_lock);
+			break;
+		}
+
+		added += gc_rq->secs_to_gc;
+		kref_put(&gc_rq->line->ref, pblk_line_put);
+		pblk_gc_free_gc_rq(gc_rq);
+	}
+
+	/* Requests are taken whole; only the padding they replace is saved */
+	if (added)
+		atomic64_add(min(added, nr_secs), &pblk->pad_gc);
+
+	return added;
+}
+
 static void pblk_gc_writer_kick(struct pblk_gc *gc)
 {
 	wake_up_process(gc->gc_writer_ts);//func pblk_gc_writer_ts
@@ -235,6 +277,9 @@ static void pblk_gc_line_prepare_ws(struct work_struct *work)
 		goto fail_free_lba_list;
 	}
 
+	atomic64_inc(&pblk->stream_gc_lines[line->stream]);
+	atomic64_add(sec_left, &pblk->stream_gc_moved[line->stream]);
+
 	bit = -1;
 next_rq:
 	gc_rq = kmalloc(sizeof(struct pblk_gc_rq), GFP_KERNEL);
@@ -39,91 +39,157 @@ static void ppa_get_l2p(struct pblk *pblk, struct ppa_addr *ppas,
 {
 	int i;
 
-	spin_lock(&pblk->trans_lock);
-	for (i = 0; i < nr_secs; i++) {
+	for (i = 0; i < nr_secs; i++)
 		ppas[i] = pblk_trans_map_get(pblk, blba + i);
-	}
-	spin_unlock(&pblk->trans_lock);
 }
 
-static bool check_ppas_seq(struct pblk *pblk, struct bio *bio)
+/*
+ * Number of leading sectors of @bio the device can serve with a single vector
+ * read. Sectors on the write buffer or not mapped are not read from the media
+ * and fit anywhere; sectors on the media must sit on the same ch/lun/blk.
+ */
+static unsigned int pblk_read_run_secs(struct pblk *pblk, struct bio *bio)
 {
-	unsigned int nr_secs = pblk_get_secs(bio);
+	unsigned int nr_secs = min_t(unsigned int, pblk_get_secs(bio),
+							pblk->max_read_pgs);
 	struct ppa_addr ppas[PBLK_MAX_REQ_ADDRS];
-	sector_t blba = pblk_get_lba(bio);
+	struct ppa_addr *first = NULL;
 	int i;
-	char str_lba[32];
-	bool result = true;
 
-	//SLC sectors == 8
-	if(nr_secs != 8) {
-		result = false;
-		goto out;
-	}
-
-	ppa_get_l2p(pblk, ppas, blba, nr_secs);
+	ppa_get_l2p(pblk, ppas, pblk_get_lba(bio), nr_secs);
 
 	for (i = 0; i < nr_secs; i++) {
-		if(ppas[i].c.is_cached == 1) {
-			//printk("%s is in cached\n", __func__);
-			break;
-		}
+		if (pblk_ppa_empty(ppas[i]) || pblk_addr_in_cache(ppas[i]))
+			continue;
 
-		//sprintf(str_lba, "lba=%6ld", blba+i);
-		//print_ppa(&pblk->dev->parent->geo, &ppas[i], str_lba, i);
-		if(i > 0) {
-			if(ppas[i].g.ch != ppas[i-1].g.ch) {
-				result = false;
-			} else if(ppas[i].g.lun != ppas[i-1].g.lun) {
-				result = false;
-			} else if(ppas[i].g.blk != ppas[i-1].g.blk) {
-				result = false;
-			//} else if(ppas[i].g.pg != ppas[i-1].g.pg) {
-			//	result = false;
-			//} else if(ppas[i].g.pl != ppas[i-1].g.pl) {
-			//	if(ppas[i].g.pl != ppas[i-1].g.pl+1 || ppas[i].g.sec != 0 || ppas[i-1].g.sec != 3) {
-			//		result = false;
-			//	}
-			//} else if(ppas[i].g.sec != ppas[i-1].g.sec+1) {
-			//	result = false;
-			}
+		if (!first) {
+			first = &ppas[i];
+			continue;
 		}
+
+		if (ppas[i].g.ch != first->g.ch ||
+				ppas[i].g.lun != first->g.lun ||
+				ppas[i].g.blk != first->g.blk)
+			break;
 	}
-out:
-	return result;
+
+	return i;
 }
+
+static void pblk_end_split(struct bio *bio, int ret)
+{
+	switch (ret) {
+	case NVM_IO_ERR:
+		bio_io_error(bio);
+		break;
+	case NVM_IO_DONE:
+		bio_endio(bio);
+		break;
+	}
+}
+
+/*
+ * Split a read at the boundaries of physical runs and at max_read_pgs, so
+ * that each piece is a single vector command. Pieces are chained to @bio,
+ * which completes once all of them do; they are submitted asynchronously and
+ * spread over the LUNs the bio maps to. Queue limits are left alone, since
+ * they are shared by all submitters.
+ */
+static int pblk_read_split_runs(struct pblk *pblk, struct bio *bio)
+{
+	struct bio *split;
+	unsigned int run;
+
+	while ((run = pblk_read_run_secs(pblk, bio)) < pblk_get_secs(bio)) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+		split = bio_split(bio, run * NR_PHY_IN_LOG, GFP_NOIO,
+								pblk_bio_set);
+#else
+		split = bio_split(bio, run * NR_PHY_IN_LOG, GFP_NOIO,
+								&pblk_bio_set);
+#endif
+		if (!split)
+			return NVM_IO_ERR;
+
+		bio_chain(split, bio);
+#ifdef CONFIG_NVM_DEBUG
+		atomic_long_inc(&pblk->read_splits);
+#endif
+		pblk_end_split(split, pblk_submit_read(pblk, split));
+	}
+
+	return pblk_submit_read(pblk, bio);
+}
+
+/*
+ * Split a write into pieces the write buffer can always take, however small
+ * it is. The queue limits cannot be relied on for this, since they are set for
+ * the whole device. Pieces are chained to @bio as for reads.
+ */
+static int pblk_write_split(struct pblk *pblk, struct bio *bio)
+{
+	unsigned int max = pblk_rl_max_io(&pblk->rl);
+	struct bio *split;
+
+	while (bio_has_data(bio) && pblk_get_secs(bio) > max) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+		split = bio_split(bio, max * NR_PHY_IN_LOG, GFP_NOIO,
+								pblk_bio_set);
+#else
+		split = bio_split(bio, max * NR_PHY_IN_LOG, GFP_NOIO,
+								&pblk_bio_set);
+#endif
+		if (!split)
+			return NVM_IO_ERR;
+
+		bio_chain(split, bio);
+
+		/* The flush goes with the first piece */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+		bio->bi_rw &= ~REQ_FLUSH;
+#else
+		bio->bi_opf &= ~REQ_PREFLUSH;
+#endif
+		pblk_end_split(split, pblk_write_to_cache(pblk, split,
+							PBLK_IOTYPE_USER));
+	}
+
+	return pblk_write_to_cache(pblk, bio, PBLK_IOTYPE_USER);
+}
+
 //bookmark: blk io的入口
 static int pblk_rw_io(struct request_queue *q, struct pblk *pblk,
 			  struct bio *bio)
 {
+	sector_t blba;
+	unsigned int nr_secs;
 	int ret;
 
-	/* Read requests must be <= 256kb due to NVMe's 64 bit completion bitmap
-	 * constraint. Writes can be of arbitrary size.
+	/* Read commands must be <= 256kb due to NVMe's 64 bit completion bitmap
+	 * constraint, which pblk_read_split_runs() takes care of. Writes can be
+	 * of arbitrary size.
 	 */
 	if (bio_data_dir(bio) == READ) {
-		bool flag_split = false;
-
-		//printk("ocssd[%s]: nr_secs=%d, bio_sectors=%d\n", __func__, pblk_get_secs(bio), bio_sectors(bio));
-		if(true != check_ppas_seq(pblk, bio)) {
-			blk_queue_max_hw_sectors(q, 1*8);
-			flag_split = true;
-		}
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
 		blk_queue_split(q, &bio, q->bio_split);
 		//printk("io_r: slba=%ld, secs=%d\n", pblk_get_lba(bio), pblk_get_secs(bio));
 #else
 		blk_queue_split(q, &bio);
 #endif
+		blba = pblk_get_lba(bio);
+		nr_secs = pblk_get_secs(bio);
 
-		ret = pblk_submit_read(pblk, bio);
+		ret = pblk_read_split_runs(pblk, bio);
 
 		if (ret == NVM_IO_DONE && bio_flagged(bio, BIO_CLONED))
 			bio_put(bio);
 
-		if(flag_split == true) {
-			blk_queue_max_hw_sectors(q, 8*8);
-		}
+		/* Streams are detected on whole bios, so that readahead does
+		 * not race the runs the bio was split into
+		 */
+		if (ret != NVM_IO_ERR)
+			pblk_read_ahead(pblk, blba, nr_secs);
+
 		return ret;
 	}
 
@@ -131,16 +197,8 @@ static int pblk_rw_io(struct request_queue *q, struct pblk *pblk,
 	 * user I/Os. Unless stalled, the rate limiter leaves at least 256KB
 	 * available for user I/O.
 	 */
-	if (pblk_get_secs(bio) > pblk_rl_max_io(&pblk->rl)) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-		blk_queue_split(q, &bio, q->bio_split);
-#else
-		blk_queue_split(q, &bio);
-#endif
-	}
-
 	//printk("io_w: slba=%ld, secs=%d\n", pblk_get_lba(bio), pblk_get_secs(bio));
-	return pblk_write_to_cache(pblk, bio, PBLK_IOTYPE_USER);
+	return pblk_write_split(pblk, bio);
 }
 
 
@@ -206,6 +264,7 @@ static u32 pblk_l2p_crc(struct pblk *pblk)
 static void pblk_l2p_free(struct pblk *pblk)
 {
 	vfree(pblk->trans_map);
+	pblk_class_free(pblk);
 }
 
 static int pblk_l2p_recover(struct pblk *pblk, bool factory_init)
@@ -248,10 +307,17 @@ static int pblk_l2p_init(struct pblk *pblk, bool factory_init)
 	int ret = 0;
 
 	printk("ocssd[%s]: {\n", __func__);
+	/* The write classifier is sized after the logical space too */
+	ret = pblk_class_init(pblk);
+	if (ret)
+		return ret;
+
 	map_size = pblk_trans_map_size(pblk);
 	pblk->trans_map = vmalloc(map_size);
-	if (!pblk->trans_map)
+	if (!pblk->trans_map) {
+		pblk_class_free(pblk);
 		return -ENOMEM;
+	}
 
 	pblk_ppa_set_empty(&ppa);
 
@@ -260,7 +326,7 @@ static int pblk_l2p_init(struct pblk *pblk, bool factory_init)
 
 	ret = pblk_l2p_recover(pblk, factory_init);
 	if (ret)
-		vfree(pblk->trans_map);
+		pblk_l2p_free(pblk);
 
 	printk("ocssd[%s]: }\n", __func__);
 	return ret;
@@ -473,10 +539,12 @@ static int pblk_core_init(struct pblk *pblk)
 	int ret;
 #endif
 	int max_write_ppas;
+	int i;
 
 	atomic64_set(&pblk->user_wa, 0);
 	atomic64_set(&pblk->pad_wa, 0);
 	atomic64_set(&pblk->gc_wa, 0);
+	atomic64_set(&pblk->coalesced_wa, 0);
 	pblk->user_rst_wa = 0;
 	pblk->pad_rst_wa = 0;
 	pblk->gc_rst_wa = 0;
@@ -484,6 +552,41 @@ static int pblk_core_init(struct pblk *pblk)
 	atomic64_set(&pblk->nr_flush, 0);
 	pblk->nr_flush_rst = 0;
 
+	pblk->flush_window_max = PBLK_FLUSH_WINDOW_US;
+	atomic64_set(&pblk->flush_last_ns, 0);
+	pblk->flush_avg_ns = 0;
+	pblk->flush_wait_pad = 0;
+	atomic64_set(&pblk->flush_windows, 0);
+	atomic64_set(&pblk->flush_pad_saved, 0);
+	atomic64_set(&pblk->pad_gc, 0);
+
+	pblk->batch_max_us = PBLK_BATCH_WAIT_US;
+	pblk->batch_target = 0;
+	pblk->batch_last_ns = 0;
+	pblk->batch_last_secs = 0;
+	pblk->batch_avg_ns = 0;
+	pblk->batch_wait_end = 0;
+	atomic64_set(&pblk->batch_waits, 0);
+	atomic64_set(&pblk->batch_timeouts, 0);
+	atomic64_set(&pblk->batch_now, 0);
+	atomic64_set(&pblk->batch_full, 0);
+	atomic64_set(&pblk->batch_reqs, 0);
+	atomic64_set(&pblk->batch_secs, 0);
+
+	pblk->nr_streams = 1;
+	pblk->slc_place_secs = 0;
+	for (i = 0; i < PBLK_NR_STREAMS; i++) {
+		atomic64_set(&pblk->stream_user[i], 0);
+		atomic64_set(&pblk->stream_gc[i], 0);
+		atomic64_set(&pblk->stream_pad[i], 0);
+		atomic64_set(&pblk->stream_lines[i], 0);
+		atomic64_set(&pblk->stream_rw[i], 0);
+		atomic64_set(&pblk->stream_rw_hit[i], 0);
+		atomic64_set(&pblk->stream_gc_lines[i], 0);
+		atomic64_set(&pblk->stream_gc_moved[i], 0);
+	}
+	atomic64_set(&pblk->stream_fallbacks, 0);
+
 	//缓存空间的大小,单位sector数
 	pblk->pgs_in_buffer = geo->mw_cunits * geo->all_luns;
 
@@ -491,7 +594,10 @@ static int pblk_core_init(struct pblk *pblk)
 	pblk->min_write_pgs = geo->ws_opt * (geo->csecs / PAGE_SIZE);
 	max_write_ppas = pblk->min_write_pgs * geo->all_luns;
 	pblk->max_write_pgs = min_t(int, max_write_ppas, NVM_MAX_VLBA);
-	pblk_set_sec_per_write(pblk, pblk->min_write_pgs);
+	pblk_set_sec_per_write(pblk, pblk->max_write_pgs);
+
+	/* Only bios spanning a full stripe skip the write buffer copy */
+	pblk->zc_min_secs = pblk->max_write_pgs;
 
 	printk("ocssd[%s]: pgs_in_buffer=%d, min_write_pgs=%d, max_write_pgs=%d\n", __func__, pblk->pgs_in_buffer, pblk->min_write_pgs, pblk->max_write_pgs);
 	if (pblk->max_write_pgs > PBLK_MAX_REQ_ADDRS) {
@@ -579,15 +685,33 @@ static int pblk_core_init(struct pblk *pblk)
 	if (!pblk->r_end_wq)
 		goto free_bb_wq;
 
-	if (pblk_set_addrf(pblk))
+	pblk->w_end_wq = alloc_workqueue("pblk-write-end-wq",
+			WQ_MEM_RECLAIM | WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!pblk->w_end_wq)
 		goto free_r_end_wq;
 
-	INIT_LIST_HEAD(&pblk->compl_list);
+	/* Write requests wait for their LUNs here, at most one per LUN runs */
+	pblk->w_sub_wq = alloc_workqueue("pblk-write-sub-wq",
+			WQ_MEM_RECLAIM | WQ_UNBOUND | WQ_HIGHPRI, geo->all_luns);
+	if (!pblk->w_sub_wq)
+		goto free_w_end_wq;
+
+	if (pblk_set_addrf(pblk))
+		goto free_w_sub_wq;
+
+	pblk->compl_queued = 0;
 	INIT_LIST_HEAD(&pblk->resubmit_list);
 
+	INIT_WORK(&pblk->w_meta_ws, pblk_submit_meta_ws);
+	atomic_set(&pblk->w_meta_queued, 0);
+
 	printk("ocssd[%s]: done\n", __func__);
 	return 0;
 
+free_w_sub_wq:
+	destroy_workqueue(pblk->w_sub_wq);
+free_w_end_wq:
+	destroy_workqueue(pblk->w_end_wq);
 free_r_end_wq:
 	destroy_workqueue(pblk->r_end_wq);
 free_bb_wq:
@@ -636,6 +760,12 @@ static void pblk_core_free(struct pblk *pblk)
 	if (pblk->r_end_wq)
 		destroy_workqueue(pblk->r_end_wq);
 
+	if (pblk->w_end_wq)
+		destroy_workqueue(pblk->w_end_wq);
+
+	if (pblk->w_sub_wq)
+		destroy_workqueue(pblk->w_sub_wq);
+
 	if (pblk->bb_wq)
 		destroy_workqueue(pblk->bb_wq);
 
@@ -806,6 +936,9 @@ static int pblk_luns_init(struct pblk *pblk)
 		rlun->bppa = dev->luns[lunid];
 
 		sema_init(&rlun->wr_sem, 1);
+		atomic_set(&rlun->map_seq, 0);
+		rlun->sub_seq = 0;
+		init_waitqueue_head(&rlun->seq_wait);
 	}
 
 	return 0;
@@ -1059,6 +1192,9 @@ static int pblk_line_mg_init(struct pblk *pblk)
 	l_mg->nr_lines = geo->num_chk;
 	printk("ocssd[%s]: init total_lines=%d\n", __func__, l_mg->nr_lines);//block nums
 	l_mg->log_line = l_mg->data_line = NULL;
+	memset(l_mg->stream_line, 0, sizeof(l_mg->stream_line));
+	memset(l_mg->stream_next, 0, sizeof(l_mg->stream_next));
+	l_mg->w_stream = 0;
 	l_mg->l_seq_nr = l_mg->d_seq_nr = 0;
 	l_mg->nr_free_lines = 0;
 	l_mg->nr_free_slc_lines = 0;
@@ -1323,8 +1459,108 @@ fail_free_meta:
 	return ret;
 }
 
+static void pblk_w_pre_free(struct pblk *pblk)
+{
+	struct nvm_tgt_dev *dev = pblk->dev;
+	struct pblk_w_prealloc *pre;
+	int i, j;
+
+	if (!pblk->w_pre)
+		return;
+
+	WARN(pblk->nr_w_pre_free != pblk->nr_w_pre,
+			"pblk: freeing write requests in use\n");
+
+	for (i = 0; i < pblk->nr_w_pre; i++) {
+		pre = &pblk->w_pre[i];
+
+		if (pre->pad_pages) {
+			for (j = 0; j < pblk->min_write_pgs; j++)
+				if (pre->pad_pages[j])
+					__free_page(pre->pad_pages[j]);
+			kfree(pre->pad_pages);
+		}
+		if (pre->meta_list)
+			pblk_dev_dma_free(dev->parent, pre->meta_list,
+							pre->dma_meta_list);
+		if (pre->bio)
+			bio_put(pre->bio);
+		kfree(pre->lun_bitmap);
+		kfree(pre->cmd);
+		kfree(pre->rqd);
+	}
+
+	kfree(pblk->w_pre);
+	pblk->w_pre = NULL;
+}
+
+/*
+ * Build the write requests the write thread reuses: one per LUN, which bounds
+ * the writes in flight, and one for the request being formed.
+ */
+static int pblk_w_pre_init(struct pblk *pblk)
+{
+	struct nvm_tgt_dev *dev = pblk->dev;
+	struct nvm_geo *geo = &dev->geo;
+	struct pblk_w_prealloc *pre;
+	int i, j;
+
+	spin_lock_init(&pblk->w_pre_lock);
+	INIT_LIST_HEAD(&pblk->w_pre_list);
+	init_waitqueue_head(&pblk->w_pre_wait);
+	atomic64_set(&pblk->w_pre_hits, 0);
+	atomic64_set(&pblk->w_pre_misses, 0);
+
+	pblk->nr_w_pre = geo->all_luns + 1;
+	pblk->nr_w_pre_free = 0;
+	pblk->w_pre = kcalloc(pblk->nr_w_pre, sizeof(struct pblk_w_prealloc),
+								GFP_KERNEL);
+	if (!pblk->w_pre)
+		return -ENOMEM;
+
+	for (i = 0; i < pblk->nr_w_pre; i++) {
+		pre = &pblk->w_pre[i];
+
+		pre->rqd = kmalloc(pblk_w_rq_size, GFP_KERNEL);
+		pre->cmd = kmalloc(NVM_RQ_CMD_SIZE, GFP_KERNEL);
+		pre->lun_bitmap = kmalloc(pblk_w_lun_ctx_len(pblk), GFP_KERNEL);
+		pre->bio = bio_kmalloc(GFP_KERNEL, pblk->max_write_pgs);
+		pre->meta_list = pblk_dev_dma_alloc(dev->parent, GFP_KERNEL,
+							&pre->dma_meta_list);
+		pre->pad_pages = kcalloc(pblk->min_write_pgs,
+					sizeof(struct page *), GFP_KERNEL);
+		if (!pre->rqd || !pre->cmd || !pre->lun_bitmap || !pre->bio ||
+					!pre->meta_list || !pre->pad_pages)
+			goto fail;
+
+		for (j = 0; j < pblk->min_write_pgs; j++) {
+			pre->pad_pages[j] = alloc_page(GFP_KERNEL);
+			if (!pre->pad_pages[j])
+				goto fail;
+		}
+
+		list_add_tail(&pre->list, &pblk->w_pre_list);
+		pblk->nr_w_pre_free++;
+	}
+
+	return 0;
+
+fail:
+	pblk->nr_w_pre_free = pblk->nr_w_pre;
+	pblk_w_pre_free(pblk);
+	return -ENOMEM;
+}
+
 static int pblk_writer_init(struct pblk *pblk)
 {
+	int ret;
+
+	ret = pblk_w_pre_init(pblk);
+	if (ret) {
+		pr_err("pblk: could not allocate write requests\n");
+		return ret;
+	}
+
 	pblk->writer_ts = kthread_create(pblk_write_ts, pblk, "pblk-writer-t");
 	if (IS_ERR(pblk->writer_ts)) {
 		int err = PTR_ERR(pblk->writer_ts);
@@ -1332,6 +1568,7 @@ static int pblk_writer_init(struct pblk *pblk)
 		if (err != -EINTR)
 			pr_err("pblk: could not allocate writer kthread (%d)\n",
 					err);
+		pblk_w_pre_free(pblk);
 		return err;
 	}
 
@@ -1360,10 +1597,13 @@ static void pblk_writer_stop(struct pblk *pblk)
 	del_timer_sync(&pblk->wtimer);
 	if (pblk->writer_ts)
 		kthread_stop(pblk->writer_ts);
+
+	pblk_w_pre_free(pblk);
 }
 
 static void pblk_free(struct pblk *pblk)
 {
+	pblk_rcache_free(pblk);
 	pblk_lines_free(pblk);
 	pblk_l2p_free(pblk);
 	pblk_rwb_free(pblk);
@@ -1443,6 +1683,13 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 	spin_lock_init(&pblk->trans_lock);
 	spin_lock_init(&pblk->lock);
 
+	/* The rate-limiter wakes up write buffer producers as soon as lines
+	 * are accounted, before the write buffer is set up
+	 */
+	init_waitqueue_head(&pblk->rwb.written_wait);
+	init_waitqueue_head(&pblk->rwb.space_wait);
+	atomic_set(&pblk->rwb.space_events, 0);
+
 #ifdef CONFIG_NVM_DEBUG
 	atomic_long_set(&pblk->inflight_writes, 0);
 	atomic_long_set(&pblk->padded_writes, 0);
@@ -1457,6 +1704,8 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 	atomic_long_set(&pblk->recov_writes, 0);
 	atomic_long_set(&pblk->recov_gc_writes, 0);
 	atomic_long_set(&pblk->recov_gc_reads, 0);
+	atomic_long_set(&pblk->zc_writes, 0);
+	atomic_long_set(&pblk->read_splits, 0);
 #endif
 
 	atomic_long_set(&pblk->read_failed, 0);
@@ -1490,12 +1739,18 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 		pr_err("pblk: could not initialize maps\n");
 		goto fail_free_rwb;
 	}
+
+	ret = pblk_rcache_init(pblk);
+	if (ret) {
+		pr_err("pblk: could not initialize read cache\n");
+		goto fail_free_l2p;
+	}
 	printk("ocssd[%s]: ###init thread write################################\n", __func__);
 	ret = pblk_writer_init(pblk);
 	if (ret) {
 		if (ret != -EINTR)
 			pr_err("pblk: could not initialize write thread\n");
-		goto fail_free_l2p;
+		goto fail_free_rcache;
 	}
 	printk("ocssd[%s]: ###init thread gc###################################\n", __func__);
 	ret = pblk_gc_init(pblk);
@@ -1508,7 +1763,13 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 	//bookmark: adjust lbs
 	printk("ocssd[%s] blk_queue_logical_block_size=%d, max_hw_sectors=%d\n", __func__, queue_physical_block_size(bqueue), queue_max_hw_sectors(bqueue));
 	blk_queue_logical_block_size(tqueue, queue_physical_block_size(bqueue));
-	blk_queue_max_hw_sectors(tqueue, queue_max_hw_sectors(bqueue));
+
+	/* Bios are taken whole (see nvm_create_tgt) and fanned out into
+	 * vector commands, which the device bounds
+	 */
+	pblk->max_read_pgs = clamp_t(unsigned int,
+			queue_max_hw_sectors(bqueue) / NR_PHY_IN_LOG,
+			1, PBLK_MAX_REQ_ADDRS);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
 	blk_queue_flush(tqueue, REQ_FLUSH);
@@ -1544,6 +1805,8 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 
 fail_stop_writer:
 	pblk_writer_stop(pblk);
+fail_free_rcache:
+	pblk_rcache_free(pblk);
 fail_free_l2p:
 	pblk_l2p_free(pblk);
 fail_free_rwb:
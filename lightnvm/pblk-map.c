@@ -18,7 +18,22 @@
 
 #include "pblk.h"
 
-static int pblk_map_page_data(struct pblk *pblk, unsigned int sentry,
+/* Return the next entry on the request, jumping over the ones that
+ * pblk_rb_read_to_bio() left out as stale
+ */
+static struct pblk_w_ctx *pblk_map_next_w_ctx(struct pblk *pblk,
+					      unsigned int *pos)
+{
+	struct pblk_w_ctx *w_ctx;
+
+	do {
+		w_ctx = pblk_rb_w_ctx(&pblk->rwb, (*pos)++);
+	} while (READ_ONCE(w_ctx->flags) & PBLK_SKIPPED_ENTRY);
+
+	return w_ctx;
+}
+
+static int pblk_map_page_data(struct pblk *pblk, unsigned int *sentry,
 			      struct ppa_addr *ppa_list,
 			      unsigned long *lun_bitmap,
 			      struct pblk_sec_meta *meta_list,
@@ -58,6 +73,10 @@ static int pblk_map_page_data(struct pblk *pblk, unsigned int sentry,
 		nr_secs = pblk->min_write_pgs;
 
 	paddr = pblk_alloc_page(pblk, line, nr_secs);
+
+	/* A reference per mapped sector, dropped once its l2p is updated */
+	if (valid_secs)
+		pblk_line_ref_get(line, min_t(int, valid_secs, nr_secs));
 	//printk("line_id=%d, paddr=%d, nr_secs=%d, valid_secs=%d\n", line->id, paddr, nr_secs, valid_secs);
 
 	for (i = 0; i < nr_secs; i++, paddr++) {
@@ -74,9 +93,7 @@ static int pblk_map_page_data(struct pblk *pblk, unsigned int sentry,
 		 * lock or memory barrier.
 		 */
 		if (i < valid_secs) {
-			kref_get(&line->ref);
-			//printk("ocssd[%s]: line_id=%d, kref_get=%d\n", __func__, line->id, atomic_read(&line->ref.refcount));
-			w_ctx = pblk_rb_w_ctx(&pblk->rwb, sentry + i);
+			w_ctx = pblk_map_next_w_ctx(pblk, sentry);
 			w_ctx->ppa = ppa_list[i];
 			meta_list[i].lba = cpu_to_le64(w_ctx->lba);
 			lba_list[paddr] = cpu_to_le64(w_ctx->lba);
@@ -93,16 +110,18 @@ static int pblk_map_page_data(struct pblk *pblk, unsigned int sentry,
 		//print_ppa(&pblk->dev->geo, &ppa_list[i], lba_str, i);
 	}
 
-	pblk_down_rq(pblk, ppa_list, nr_secs, lun_bitmap);
+	/* LUNs are locked on submission (see pblk_down_rq) */
+	set_bit(pblk_ppa_to_pos(&pblk->dev->geo, ppa_list[0]), lun_bitmap);
 	return 0;
 }
 
-void pblk_map_rq(struct pblk *pblk, struct nvm_rq *rqd, unsigned int sentry,
-		 unsigned long *lun_bitmap, unsigned int valid_secs,
-		 unsigned int off)
+int pblk_map_rq(struct pblk *pblk, struct nvm_rq *rqd, unsigned int sentry,
+		unsigned long *lun_bitmap, unsigned int valid_secs,
+		unsigned int off)
 {
 	struct pblk_sec_meta *meta_list = rqd->meta_list;
 	unsigned int map_secs;
+	unsigned int pos = sentry;
 	int min = pblk_get_min_write_pgs(pblk);
 	int i, rlt;
 
@@ -112,12 +131,11 @@ void pblk_map_rq(struct pblk *pblk, struct nvm_rq *rqd, unsigned int sentry,
 	for (i = off; i < rqd->nr_ppas; ) {
 		map_secs = (i + min > valid_secs) ? (valid_secs % min) : min;
 
-		rlt = pblk_map_page_data(pblk, sentry + i, &rqd->ppa_list[i], lun_bitmap, &meta_list[i], map_secs);
+		rlt = pblk_map_page_data(pblk, &pos, &rqd->ppa_list[i], lun_bitmap, &meta_list[i], map_secs);
 		if (rlt < 0) {
-			bio_put(rqd->bio);
-			pblk_free_rqd(pblk, rqd, PBLK_WRITE);
+			/* The caller owns the request */
 			pblk_pipeline_stop(pblk);
-			i += min;
+			return rlt;
 		} else if(rlt == 1) {
 			min = pblk_get_min_write_pgs(pblk);
 
@@ -127,12 +145,14 @@ void pblk_map_rq(struct pblk *pblk, struct nvm_rq *rqd, unsigned int sentry,
 			i += min;
 		}
 	}
+
+	return 0;
 }
 
 /* only if erase_ppa is set, acquire erase semaphore */
-void pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
-		       unsigned int sentry, unsigned long *lun_bitmap,
-		       unsigned int valid_secs, struct ppa_addr *erase_ppa)
+int pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
+		      unsigned int sentry, unsigned long *lun_bitmap,
+		      unsigned int valid_secs, struct ppa_addr *erase_ppa)
 {
 	struct nvm_tgt_dev *dev = pblk->dev;
 	struct nvm_geo *geo = &dev->geo;
@@ -140,17 +160,23 @@ void pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
 	struct pblk_sec_meta *meta_list = rqd->meta_list;
 	struct pblk_line *e_line, *d_line;
 	unsigned int map_secs;
+	unsigned int pos = sentry;
 	int min = pblk_get_min_write_pgs(pblk);
-	int i, erase_lun;
+	int i, erase_lun, ret;
 
 	for (i = 0; i < rqd->nr_ppas; i += min) {
 		map_secs = (i + min > valid_secs) ? (valid_secs % min) : min;
 
-		if (pblk_map_page_data(pblk, sentry + i, &rqd->ppa_list[i],
-					lun_bitmap, &meta_list[i], map_secs)) {
-			bio_put(rqd->bio);
-			pblk_free_rqd(pblk, rqd, PBLK_WRITE);
+		ret = pblk_map_page_data(pblk, &pos, &rqd->ppa_list[i],
+					lun_bitmap, &meta_list[i], map_secs);
+		if (ret < 0) {
+			/* The caller owns the request */
 			pblk_pipeline_stop(pblk);
+			return ret;
+		} else if (ret == 1) {
+			/* The data line was replaced before mapping anything */
+			return pblk_map_rq(pblk, rqd, pos, lun_bitmap,
+							valid_secs, i);
 		}
 
 		erase_lun = pblk_ppa_to_pos(geo, rqd->ppa_list[i]);
@@ -160,7 +186,7 @@ void pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
 		 */
 		e_line = pblk_line_get_erase(pblk);
 		if (!e_line)
-			return pblk_map_rq(pblk, rqd, sentry, lun_bitmap,
+			return pblk_map_rq(pblk, rqd, pos, lun_bitmap,
 							valid_secs, i + min);
 
 		spin_lock(&e_line->lock);
@@ -176,7 +202,7 @@ void pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
 			spin_unlock(&e_line->lock);
 
 			/* Avoid evaluating e_line->left_eblks */
-			return pblk_map_rq(pblk, rqd, sentry, lun_bitmap,
+			return pblk_map_rq(pblk, rqd, pos, lun_bitmap,
 							valid_secs, i + min);
 		}
 		spin_unlock(&e_line->lock);
@@ -189,7 +215,7 @@ void pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
 	 */
 	e_line = pblk_line_get_erase(pblk);
 	if (!e_line)
-		return;
+		return 0;
 
 	/* Erase blocks that are bad in this line but might not be in next */
 	if (unlikely(pblk_ppa_empty(*erase_ppa)) &&
@@ -200,7 +226,7 @@ retry:
 		bit = find_next_bit(d_line->blk_bitmap,
 						lm->blk_per_line, bit + 1);
 		if (bit >= lm->blk_per_line)
-			return;
+			return 0;
 
 		spin_lock(&e_line->lock);
 		if (test_bit(bit, e_line->erase_bitmap)) {
@@ -214,4 +240,6 @@ retry:
 		*erase_ppa = pblk->luns[bit].bppa; /* set ch and lun */
 		erase_ppa->a.blk = e_line->id;
 	}
+
+	return 0;
 }
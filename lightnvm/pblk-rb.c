@@ -22,45 +22,37 @@
 
 static DECLARE_RWSEM(pblk_rb_lock);
 
-void pblk_rb_data_free(struct pblk_rb *rb)
+static void __pblk_rb_data_free(struct list_head *pages)
 {
 	struct pblk_rb_pages *p, *t;
 
-	down_write(&pblk_rb_lock);
-	list_for_each_entry_safe(p, t, &rb->pages, list) {
+	list_for_each_entry_safe(p, t, pages, list) {
 		free_pages((unsigned long)page_address(p->pages), p->order);
 		list_del(&p->list);
 		kfree(p);
 	}
+}
+
+void pblk_rb_data_free(struct pblk_rb *rb)
+{
+	down_write(&pblk_rb_lock);
+	__pblk_rb_data_free(&rb->pages);
 	up_write(&pblk_rb_lock);
 }
 
 /*
- * Initialize ring buffer. The data and metadata buffers must be previously
- * allocated and their size must be a power of two
- * (Documentation/core-api/circular-buffers.rst)
+ * Allocate the data buffer backing 2^@power_size @entries of @seg_size bytes
+ * and point the entries to it. Pages are linked on @pages.
  */
-int pblk_rb_init(struct pblk_rb *rb, struct pblk_rb_entry *rb_entry_base,
-		 unsigned int power_size, unsigned int power_seg_sz)
+static int pblk_rb_data_alloc(struct pblk_rb_entry *entries,
+			      struct list_head *pages,
+			      unsigned int power_size, unsigned int seg_size)
 {
-	struct pblk *pblk = container_of(rb, struct pblk, rwb);
 	unsigned int init_entry = 0;
 	unsigned int alloc_order = power_size;
 	unsigned int max_order = MAX_ORDER - 1;
 	unsigned int order, iter;
 
-	down_write(&pblk_rb_lock);
-	rb->entries = rb_entry_base;
-	rb->seg_size = (1 << power_seg_sz);
-	rb->nr_entries = (1 << power_size);
-	rb->mem = rb->subm = rb->sync = rb->l2p_update = 0;
-	rb->flush_point = EMPTY_ENTRY;
-
-	spin_lock_init(&rb->w_lock);
-	spin_lock_init(&rb->s_lock);
-
-	INIT_LIST_HEAD(&rb->pages);
-
 	if (alloc_order >= max_order) {
 		order = max_order;
 		iter = (1 << (alloc_order - max_order));
@@ -77,39 +69,67 @@ int pblk_rb_init(struct pblk_rb *rb, struct pblk_rb_entry *rb_entry_base,
 		int i;
 
 		page_set = kmalloc(sizeof(struct pblk_rb_pages), GFP_KERNEL);
-		if (!page_set) {
-			up_write(&pblk_rb_lock);
-			return -ENOMEM;
-		}
+		if (!page_set)
+			goto fail;
 
 		page_set->order = order;
 		page_set->pages = alloc_pages(GFP_KERNEL, order);
 		if (!page_set->pages) {
 			kfree(page_set);
-			pblk_rb_data_free(rb);
-			up_write(&pblk_rb_lock);
-			return -ENOMEM;
+			goto fail;
 		}
 		kaddr = page_address(page_set->pages);
 
-		entry = &rb->entries[init_entry];
-		entry->data = kaddr;
-		entry->cacheline = pblk_cacheline_to_addr(init_entry++);
-		entry->w_ctx.flags = PBLK_WRITABLE_ENTRY;
-
 		set_size = (1 << order);
-		for (i = 1; i < set_size; i++) {
-			entry = &rb->entries[init_entry];
+		for (i = 0; i < set_size; i++) {
+			entry = &entries[init_entry];
 			entry->cacheline = pblk_cacheline_to_addr(init_entry++);
-			entry->data = kaddr + (i * rb->seg_size);
+			entry->data = kaddr + (i * seg_size);
 			entry->w_ctx.flags = PBLK_WRITABLE_ENTRY;
 			bio_list_init(&entry->w_ctx.bios);
 		}
 
-		list_add_tail(&page_set->list, &rb->pages);
+		list_add_tail(&page_set->list, pages);
 		iter--;
 	} while (iter > 0);
+
+	return 0;
+
+fail:
+	__pblk_rb_data_free(pages);
+	return -ENOMEM;
+}
+
+/*
+ * Initialize ring buffer. The data and metadata buffers must be previously
+ * allocated and their size must be a power of two
+ * (Documentation/core-api/circular-buffers.rst)
+ */
+int pblk_rb_init(struct pblk_rb *rb, struct pblk_rb_entry *rb_entry_base,
+		 unsigned int power_size, unsigned int power_seg_sz)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	int ret;
+
+	down_write(&pblk_rb_lock);
+	rb->entries = rb_entry_base;
+	rb->seg_size = (1 << power_seg_sz);
+	rb->nr_entries = (1 << power_size);
+	rb->mem = rb->subm = rb->sync = rb->l2p_update = 0;
+	rb->flush_head = rb->flush_tail = 0;
+	rb->frozen = 0;
+
+	mutex_init(&rb->resize_lock);
+	spin_lock_init(&rb->w_lock);
+	spin_lock_init(&rb->s_lock);
+
+	INIT_LIST_HEAD(&rb->pages);
+
+	ret = pblk_rb_data_alloc(rb->entries, &rb->pages, power_size,
+							rb->seg_size);
 	up_write(&pblk_rb_lock);
+	if (ret)
+		return ret;
 
 #ifdef CONFIG_NVM_DEBUG
 	atomic_set(&rb->inflight_flush_point, 0);
@@ -125,6 +145,78 @@ int pblk_rb_init(struct pblk_rb *rb, struct pblk_rb_entry *rb_entry_base,
 	return 0;
 }
 
+/*
+ * Resize the write buffer to @nr_entries, a power of two. Producers are held
+ * back while the buffer drains to the sync pointer; once the L2P table points
+ * to the media for every entry, entries and data pages are replaced and the
+ * rate-limiter budgets are recalculated. Readers of cachelines revalidate the
+ * L2P under w_lock, so they fall back to the media.
+ */
+int pblk_rb_resize(struct pblk_rb *rb, unsigned int nr_entries)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	struct pblk_rb_entry *entries, *old_entries;
+	LIST_HEAD(pages);
+	LIST_HEAD(old_pages);
+	int ret;
+
+	if (nr_entries == READ_ONCE(rb->nr_entries))
+		return 0;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+	entries = vzalloc(nr_entries * sizeof(struct pblk_rb_entry));
+#else
+	entries = vzalloc(array_size(nr_entries, sizeof(struct pblk_rb_entry)));
+#endif
+	if (!entries)
+		return -ENOMEM;
+
+	ret = pblk_rb_data_alloc(entries, &pages, get_count_order(nr_entries),
+							rb->seg_size);
+	if (ret) {
+		vfree(entries);
+		return ret;
+	}
+
+	mutex_lock(&rb->resize_lock);
+
+	/* Producers that did not see the buffer frozen have claimed their
+	 * entries by the end of the grace period
+	 */
+	WRITE_ONCE(rb->frozen, 1);
+	synchronize_rcu();
+
+	/* Every sync advance wakes up space_wait */
+	pblk_rb_flush(rb);
+	wait_event(rb->space_wait, !pblk_rb_sync_count(rb));
+	pblk_rb_sync_l2p(rb);
+
+	spin_lock(&rb->w_lock);
+	spin_lock_irq(&rb->s_lock);
+	old_entries = rb->entries;
+	rb->entries = entries;
+	rb->nr_entries = nr_entries;
+	rb->mem = rb->subm = rb->sync = rb->l2p_update = 0;
+	rb->flush_head = rb->flush_tail = 0;
+	list_splice_init(&rb->pages, &old_pages);
+	list_splice_init(&pages, &rb->pages);
+	spin_unlock_irq(&rb->s_lock);
+	spin_unlock(&rb->w_lock);
+
+	pblk_rl_resize(&pblk->rl, nr_entries);
+
+	WRITE_ONCE(rb->frozen, 0);
+	mutex_unlock(&rb->resize_lock);
+	pblk_rb_wake_producers(rb);
+
+	pr_info("pblk: write buffer resized to %u entries\n", nr_entries);
+
+	__pblk_rb_data_free(&old_pages);
+	vfree(old_entries);
+
+	return 0;
+}
+
 /*
  * pblk_rb_calculate_size -- calculate the size of the write buffer
  */
@@ -139,6 +231,41 @@ void *pblk_rb_entries_ref(struct pblk_rb *rb)
 	return rb->entries;
 }
 
+/*
+ * Producers that do not fit on the write buffer sleep until entries or budget
+ * are given back. They take an event snapshot before trying to get in, so a
+ * release that happens before they sleep is not missed.
+ */
+unsigned int pblk_rb_space_event(struct pblk_rb *rb)
+{
+	return atomic_read(&rb->space_events);
+}
+
+void pblk_rb_wait_space(struct pblk_rb *rb, unsigned int event)
+{
+	wait_event(rb->space_wait, atomic_read(&rb->space_events) != event);
+}
+
+void pblk_rb_wake_producers(struct pblk_rb *rb)
+{
+	atomic_inc(&rb->space_events);
+
+	/* Orders the event with the waiters check */
+	if (wq_has_sleeper(&rb->space_wait))
+		wake_up_all(&rb->space_wait);
+}
+
+/* Publish a written entry to the write thread */
+static void pblk_rb_entry_written(struct pblk_rb *rb,
+				  struct pblk_rb_entry *entry, int flags)
+{
+	/* Release flags on write context. Protect from writes */
+	smp_store_release(&entry->w_ctx.flags, flags);
+
+	if (wq_has_sleeper(&rb->written_wait))
+		wake_up(&rb->written_wait);
+}
+
 static void clean_wctx(struct pblk_w_ctx *w_ctx)
 {
 	int flags;
@@ -147,11 +274,14 @@ static void clean_wctx(struct pblk_w_ctx *w_ctx)
 	WARN_ONCE(!(flags & PBLK_SUBMITTED_ENTRY),
 			"pblk: overwriting unsubmitted data\n");
 
-	/* Release flags on context. Protect from writes and reads */
-	smp_store_release(&w_ctx->flags, PBLK_WRITABLE_ENTRY);
-
 	pblk_ppa_set_empty(&w_ctx->ppa);
 	w_ctx->lba = ADDR_EMPTY;
+
+	/* Release flags on context. Producers can take the entry as soon as
+	 * they see it writable, so the context must be clean by then.
+	 * Protect from writes and reads
+	 */
+	smp_store_release(&w_ctx->flags, PBLK_WRITABLE_ENTRY);
 }
 
 #define pblk_rb_ring_count(head, tail, size) CIRC_CNT(head, tail, size)
@@ -190,6 +320,12 @@ unsigned int pblk_rb_sync_count(struct pblk_rb *rb)
 	return pblk_rb_ring_count(mem, sync, rb->nr_entries);
 }
 
+/* Next entry to be read by the write thread */
+unsigned int pblk_rb_read_pos(struct pblk_rb *rb)
+{
+	return READ_ONCE(rb->subm);
+}
+
 unsigned int pblk_rb_read_commit(struct pblk_rb *rb, unsigned int nr_entries)
 {
 	unsigned int subm;
@@ -202,9 +338,58 @@ unsigned int pblk_rb_read_commit(struct pblk_rb *rb, unsigned int nr_entries)
 	return subm;
 }
 
+/*
+ * Move the l2p of @nr_entries synced entries from @pos to their device
+ * addresses. trans_lock is taken once per PBLK_L2P_BATCH entries, and the
+ * l2p entries of the following sectors are prefetched. With @zc set, only
+ * zero-copy entries are updated and released from the user pages; otherwise
+ * they are skipped, together with entries that were never mapped.
+ */
+static void pblk_rb_update_map_dev(struct pblk_rb *rb, unsigned int pos,
+				   unsigned int nr_entries, bool zc)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	unsigned int mask = rb->nr_entries - 1;
+	struct pblk_rb_entry *entry;
+	struct pblk_w_ctx *w_ctx;
+	unsigned int i;
+	int flags;
+
+	spin_lock(&pblk->trans_lock);
+	for (i = 0; i < nr_entries; i++) {
+		if (i && !(i % PBLK_L2P_BATCH)) {
+			spin_unlock(&pblk->trans_lock);
+			spin_lock(&pblk->trans_lock);
+		}
+
+		if (i + PBLK_L2P_PREFETCH < nr_entries) {
+			entry = &rb->entries[(pos + i + PBLK_L2P_PREFETCH) & mask];
+			pblk_trans_map_prefetch(pblk, entry->w_ctx.lba);
+		}
+
+		entry = &rb->entries[(pos + i) & mask];
+		w_ctx = &entry->w_ctx;
+
+		if (zc) {
+			if (!entry->zc_data)
+				continue;
+			entry->zc_data = NULL;
+		} else {
+			flags = READ_ONCE(w_ctx->flags);
+			if (flags & (PBLK_SKIPPED_ENTRY | PBLK_ZC_ENTRY))
+				continue;
+		}
+
+		__pblk_update_map_dev(pblk, w_ctx->lba, w_ctx->ppa,
+							entry->cacheline);
+	}
+	spin_unlock(&pblk->trans_lock);
+}
+
 static int __pblk_rb_update_l2p(struct pblk_rb *rb, unsigned int to_update)
 {
 	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	struct pblk_line_refs refs = PBLK_LINE_REFS_INIT;
 	struct pblk_line *line;
 	struct pblk_rb_entry *entry;
 	struct pblk_w_ctx *w_ctx;
@@ -212,6 +397,8 @@ static int __pblk_rb_update_l2p(struct pblk_rb *rb, unsigned int to_update)
 	unsigned int i;
 	int flags;
 
+	pblk_rb_update_map_dev(rb, rb->l2p_update, to_update, false);
+
 	for (i = 0; i < to_update; i++) {
 		entry = &rb->entries[rb->l2p_update];
 		w_ctx = &entry->w_ctx;
@@ -224,20 +411,24 @@ static int __pblk_rb_update_l2p(struct pblk_rb *rb, unsigned int to_update)
 		else
 			WARN(1, "pblk: unknown IO type\n");
 
-		pblk_update_map_dev(pblk, w_ctx->lba, w_ctx->ppa,
-							entry->cacheline);
+		/* Skipped entries were never mapped to the media */
+		if (flags & PBLK_SKIPPED_ENTRY)
+			goto clean;
 
 		line = &pblk->lines[pblk_ppa_to_line(w_ctx->ppa)];
-		if(1 == kref_put(&line->ref, pblk_line_put)) {
-			printk("ocssd[%s]: kref_put\n", __func__);
-		}
+		pblk_line_refs_put(&refs, line, pblk_line_put);
+clean:
+		entry->zc_data = NULL;
 		//bookmark: clean w_ctx->flags
 		clean_wctx(w_ctx);
 
 		rb->l2p_update = (rb->l2p_update + 1) & (rb->nr_entries - 1);
 	}
+	pblk_line_refs_put_flush(&refs, pblk_line_put);
 
 	pblk_rl_out(&pblk->rl, user_io, gc_io);
+	if (to_update)
+		pblk_rb_wake_producers(rb);
 
 	return 0;
 }
@@ -246,26 +437,31 @@ static int __pblk_rb_update_l2p(struct pblk_rb *rb, unsigned int to_update)
  * When we move the l2p_update pointer, we update the l2p table - lookups will
  * point to the physical address instead of to the cacheline in the write buffer
  * from this moment on.
+ *
+ * Producers reserve entries without holding rb->w_lock, so the l2p update is
+ * done by the producer that needs the entries back. Entries are updated in
+ * order, thus if the last entry on the reserved range is writable, all entries
+ * before it are writable too and the lock can be skipped.
  */
-static int pblk_rb_update_l2p(struct pblk_rb *rb, unsigned int nr_entries,
-			      unsigned int mem, unsigned int sync)
+static void pblk_rb_update_l2p(struct pblk_rb *rb, unsigned int pos,
+			       unsigned int nr_entries)
 {
-	unsigned int space, count;
-	int ret = 0;
-
-	lockdep_assert_held(&rb->w_lock);
-
-	/* Update l2p only as buffer entries are being overwritten */
-	space = pblk_rb_ring_space(rb, mem, rb->l2p_update, rb->nr_entries);
-	if (space > nr_entries)
-		goto out;
+	unsigned int last = (pos + nr_entries - 1) & (rb->nr_entries - 1);
+	unsigned int count;
 
-	count = nr_entries - space;
-	/* l2p_update used exclusively under rb->w_lock */
-	ret = __pblk_rb_update_l2p(rb, count);
+	/* Protect from l2p updates */
+	if (smp_load_acquire(&rb->entries[last].w_ctx.flags) &
+							PBLK_WRITABLE_ENTRY)
+		return;
 
-out:
-	return ret;
+	spin_lock(&rb->w_lock);
+	if (!(READ_ONCE(rb->entries[last].w_ctx.flags) & PBLK_WRITABLE_ENTRY)) {
+		/* l2p_update used exclusively under rb->w_lock */
+		count = pblk_rb_ring_count(last + 1, rb->l2p_update,
+							rb->nr_entries);
+		__pblk_rb_update_l2p(rb, count);
+	}
+	spin_unlock(&rb->w_lock);
 }
 
 /*
@@ -303,6 +499,7 @@ static void __pblk_rb_write_entry(struct pblk_rb *rb, void *data,
 
 	entry->w_ctx.lba = w_ctx.lba;
 	entry->w_ctx.ppa = w_ctx.ppa;
+	entry->w_ctx.stream = w_ctx.stream;
 }
 
 void pblk_rb_write_entry_user(struct pblk_rb *rb, void *data,
@@ -321,18 +518,22 @@ void pblk_rb_write_entry_user(struct pblk_rb *rb, void *data,
 
 	__pblk_rb_write_entry(rb, data, w_ctx, entry);
 
-	pblk_update_map_cache(pblk, w_ctx.lba, entry->cacheline);
+	entry->w_ctx.seq_floor = pblk_update_map_cache(pblk, w_ctx.lba,
+					entry->cacheline, w_ctx.stream);
 
 	flags = w_ctx.flags | PBLK_WRITTEN_DATA;
 
 	//printk("ocssd[%s]: ring_pos=%d, old.flags=0x%x, new.flags=0x%x\n", __func__, ring_pos, entry->w_ctx.flags, flags);
-	/* Release flags on write context. Protect from writes */
-	smp_store_release(&entry->w_ctx.flags, flags);
+	pblk_rb_entry_written(rb, entry, flags);
 }
 
-void pblk_rb_write_entry_gc(struct pblk_rb *rb, void *data,
-			    struct pblk_w_ctx w_ctx, struct pblk_line *line,
-			    u64 paddr, unsigned int ring_pos)
+/*
+ * Store a user sector without copying it. The entry points to the page of the
+ * user bio, which is held on the write buffer (pblk_rb_hold_bio) until the
+ * entry is persisted.
+ */
+void pblk_rb_write_entry_zc(struct pblk_rb *rb, void *data,
+			    struct pblk_w_ctx w_ctx, unsigned int ring_pos)
 {
 	struct pblk *pblk = container_of(rb, struct pblk, rwb);
 	struct pblk_rb_entry *entry;
@@ -342,27 +543,166 @@ void pblk_rb_write_entry_gc(struct pblk_rb *rb, void *data,
 	flags = READ_ONCE(entry->w_ctx.flags);
 #ifdef CONFIG_NVM_DEBUG
 	/* Caller must guarantee that the entry is free */
-	//printk("ocssd[%s]: ring_pos=%d, flags=0x%x\n", __func__, ring_pos, flags);
 	BUG_ON(!(flags & PBLK_WRITABLE_ENTRY));
 #endif
 
-	__pblk_rb_write_entry(rb, data, w_ctx, entry);
+	entry->zc_data = data;
+	entry->w_ctx.lba = w_ctx.lba;
+	entry->w_ctx.ppa = w_ctx.ppa;
+	entry->w_ctx.stream = w_ctx.stream;
 
-	if (!pblk_update_map_gc(pblk, w_ctx.lba, entry->cacheline, line, paddr))
-		entry->w_ctx.lba = ADDR_EMPTY;
+	entry->w_ctx.seq_floor = pblk_update_map_cache(pblk, w_ctx.lba,
+					entry->cacheline, w_ctx.stream);
 
-	flags = w_ctx.flags | PBLK_WRITTEN_DATA;
+	flags = w_ctx.flags | PBLK_ZC_ENTRY | PBLK_WRITTEN_DATA;
 
-	//printk("ocssd[%s]: ring_pos=%d, old.flags=0x%x, new.flags=0x%x\n", __func__, ring_pos, entry->w_ctx.flags, flags);
-	/* Release flags on write context. Protect from writes */
-	smp_store_release(&entry->w_ctx.flags, flags);
+	pblk_rb_entry_written(rb, entry, flags);
+}
+
+/*
+ * Complete @bio together with the entry at @pos. The caller must hold the
+ * entry, i.e., not have marked it as written yet.
+ */
+void pblk_rb_hold_bio(struct pblk_rb *rb, struct bio *bio, unsigned int pos)
+{
+	struct pblk_rb_entry *entry = &rb->entries[pos];
+
+	pblk_rb_sync_init(rb, NULL);
+	bio_list_add(&entry->w_ctx.bios, bio);
+	pblk_rb_sync_end(rb, NULL);
+}
+
+/*
+ * The user bio backing zero-copy entries is completed as soon as they are
+ * synced, and its pages can be reused right after. Move their l2p mapping to
+ * the device before that happens so that no read is served from those pages
+ * anymore. rb->w_lock waits for readers that are still copying from them.
+ */
+void pblk_rb_zc_release(struct pblk_rb *rb, unsigned int pos,
+			unsigned int nr_entries)
+{
+	spin_lock(&rb->w_lock);
+	pblk_rb_update_map_dev(rb, pos, nr_entries, true);
+	spin_unlock(&rb->w_lock);
+}
+
+bool pblk_rb_fills_rcache(struct pblk_rb *rb)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+
+	return (READ_ONCE(pblk->rc.fill) & PBLK_RC_FILL_WB) &&
+					READ_ONCE(pblk->rc.max_pages);
+}
+
+/*
+ * User data leaving the buffer is still hot; cache the entries of a write
+ * that has just completed. They cannot be reused until the sync pointer moves
+ * past them, so no lock is needed. Their l2p still points to the cacheline,
+ * and is moved to the device later on. Zero-copy entries point to pages that
+ * are not ours anymore.
+ */
+void pblk_rb_fill_rcache(struct pblk_rb *rb, unsigned int pos,
+			 unsigned int nr_entries)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	struct pblk_rb_entry *entry;
+	struct pblk_w_ctx *w_ctx;
+	unsigned int i;
+	int flags;
+
+	for (i = 0; i < nr_entries; i++) {
+		entry = &rb->entries[pblk_rb_wrap_pos(rb, pos + i)];
+		w_ctx = &entry->w_ctx;
+
+		flags = READ_ONCE(w_ctx->flags);
+		if (!(flags & PBLK_IOTYPE_USER) ||
+				(flags & (PBLK_ZC_ENTRY | PBLK_SKIPPED_ENTRY)) ||
+				w_ctx->lba == ADDR_EMPTY)
+			continue;
+
+		pblk_rcache_fill(pblk, w_ctx->lba, w_ctx->ppa, entry->cacheline,
+						entry->data, PBLK_RC_SRC_WB);
+	}
+}
+
+/*
+ * Store the valid sectors of @gc_rq on consecutive entries from @pos. Their
+ * l2p is moved to the write buffer under a single trans_lock, unless the lba
+ * has been updated since GC read it, and their read cache pages are dropped
+ * after it. Returns the number of entries written.
+ */
+unsigned int pblk_rb_write_entries_gc(struct pblk_rb *rb,
+				      struct pblk_gc_rq *gc_rq,
+				      struct pblk_w_ctx w_ctx, unsigned int pos)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	struct pblk_line *line = gc_rq->line;
+	struct pblk_rb_entry *entry;
+	unsigned int valid;
+	int flags = w_ctx.flags | PBLK_WRITTEN_DATA;
+	int i;
+
+	for (i = 0, valid = 0; i < gc_rq->nr_secs; i++) {
+		if (gc_rq->lba_list[i] == ADDR_EMPTY)
+			continue;
+
+		entry = &rb->entries[pblk_rb_wrap_pos(rb, pos + valid)];
+#ifdef CONFIG_NVM_DEBUG
+		/* Caller must guarantee that the entry is free */
+		BUG_ON(!(READ_ONCE(entry->w_ctx.flags) & PBLK_WRITABLE_ENTRY));
+#endif
+		w_ctx.lba = gc_rq->lba_list[i];
+		__pblk_rb_write_entry(rb, gc_rq->data + i * PAGE_SIZE, w_ctx,
+									entry);
+		entry->w_ctx.seq_floor = line->seq_nr;
+		valid++;
+	}
+
+	spin_lock(&pblk->trans_lock);
+	for (i = 0, valid = 0; i < gc_rq->nr_secs; i++) {
+		if (gc_rq->lba_list[i] == ADDR_EMPTY)
+			continue;
+
+		entry = &rb->entries[pblk_rb_wrap_pos(rb, pos + valid)];
+		if (!__pblk_update_map_gc(pblk, entry->w_ctx.lba,
+				entry->cacheline, line, gc_rq->paddr_list[i]))
+			entry->w_ctx.lba = ADDR_EMPTY;
+		valid++;
+	}
+	spin_unlock(&pblk->trans_lock);
+
+	for (i = 0; i < valid; i++) {
+		entry = &rb->entries[pblk_rb_wrap_pos(rb, pos + i)];
+		if (entry->w_ctx.lba != ADDR_EMPTY)
+			pblk_rcache_invalidate(pblk, entry->w_ctx.lba, 1);
+		pblk_rb_entry_written(rb, entry, flags);
+	}
+
+	return valid;
+}
+
+static inline bool pblk_rb_flush_pending(struct pblk_rb *rb)
+{
+	return READ_ONCE(rb->flush_head) != READ_ONCE(rb->flush_tail);
+}
+
+static inline unsigned int *pblk_rb_flush_slot(struct pblk_rb *rb,
+					       unsigned int seq)
+{
+	return &rb->flush_points[seq & (PBLK_MAX_FLUSH_POINTS - 1)];
+}
+
+/* Newest pending flush point. Caller holds s_lock */
+static unsigned int pblk_rb_flush_point_last(struct pblk_rb *rb)
+{
+	return *pblk_rb_flush_slot(rb, rb->flush_tail - 1);
 }
 
 static int pblk_rb_flush_point_set(struct pblk_rb *rb, struct bio *bio,
 				   unsigned int pos)
 {
 	struct pblk_rb_entry *entry;
-	unsigned int sync, flush_point;
+	unsigned int sync, flush_point, cur_point;
 
 	pblk_rb_sync_init(rb, NULL);
 	sync = READ_ONCE(rb->sync);
@@ -379,8 +719,30 @@ static int pblk_rb_flush_point_set(struct pblk_rb *rb, struct bio *bio,
 	flush_point = (pos == 0) ? (rb->nr_entries - 1) : (pos - 1);
 	entry = &rb->entries[flush_point];
 
-	/* Protect flush points */
-	smp_store_release(&rb->flush_point, flush_point);
+	/* Producers are not serialized anymore, so a flush reserved earlier
+	 * can get here after a later one; the newest flush point covers it
+	 * already. If the queue is full, the newest point moves forward and
+	 * takes over the new flush
+	 */
+	if (!pblk_rb_flush_pending(rb)) {
+		*pblk_rb_flush_slot(rb, rb->flush_tail) = flush_point;
+		WRITE_ONCE(rb->flush_tail, rb->flush_tail + 1);
+		goto out;
+	}
+
+	cur_point = pblk_rb_flush_point_last(rb);
+	if (pblk_rb_ring_count(cur_point, sync, rb->nr_entries) >=
+			pblk_rb_ring_count(flush_point, sync, rb->nr_entries))
+		goto out;
+
+	if (rb->flush_tail - rb->flush_head < PBLK_MAX_FLUSH_POINTS) {
+		*pblk_rb_flush_slot(rb, rb->flush_tail) = flush_point;
+		WRITE_ONCE(rb->flush_tail, rb->flush_tail + 1);
+	} else {
+		*pblk_rb_flush_slot(rb, rb->flush_tail - 1) = flush_point;
+	}
+
+out:
 
 	if (bio)
 		bio_list_add(&entry->w_ctx.bios, bio);
@@ -390,24 +752,45 @@ static int pblk_rb_flush_point_set(struct pblk_rb *rb, struct bio *bio,
 	return bio ? 1 : 0;
 }
 
+/*
+ * Reserve @nr_entries on the write buffer. Producers claim their range by
+ * moving rb->mem forward with cmpxchg, which publishes the entries to the
+ * write thread; pblk_rb_read_to_bio() waits for PBLK_WRITTEN_DATA before
+ * submitting them, so the data can be copied after the reservation.
+ */
 static int __pblk_rb_may_write(struct pblk_rb *rb, unsigned int nr_entries,
-			       unsigned int *pos, bool flag_gc)
+			       unsigned int *pos)
 {
-	unsigned int mem;
+	unsigned int mem, new_mem;
 	unsigned int sync;
 	unsigned int nr_ring_space;
 
-	sync = READ_ONCE(rb->sync);
-	mem = READ_ONCE(rb->mem);
-
-	nr_ring_space = pblk_rb_ring_space(rb, mem, sync, rb->nr_entries);
-	if (nr_ring_space < nr_entries) {
-		//printk("ocssd[%s]: ring_space=%d < %d\n", __func__, nr_ring_space, nr_entries);
+	/* The buffer is frozen while it is resized (see pblk_rb_resize()) */
+	rcu_read_lock();
+	if (unlikely(READ_ONCE(rb->frozen))) {
+		rcu_read_unlock();
 		return 0;
 	}
 
-	if (pblk_rb_update_l2p(rb, nr_entries, mem, sync))
-		return 0;
+	do {
+		/* mem must be read before sync; otherwise a stale sync could
+		 * report space that has already been taken by others
+		 */
+		mem = smp_load_acquire(&rb->mem);
+		sync = READ_ONCE(rb->sync);
+
+		nr_ring_space = pblk_rb_ring_space(rb, mem, sync,
+							rb->nr_entries);
+		if (nr_ring_space < nr_entries) {
+			rcu_read_unlock();
+			return 0;
+		}
+
+		new_mem = (mem + nr_entries) & (rb->nr_entries - 1);
+	} while (cmpxchg(&rb->mem, mem, new_mem) != mem);
+
+	pblk_rb_update_l2p(rb, mem, nr_entries);
+	rcu_read_unlock();
 
 	*pos = mem;
 
@@ -417,12 +800,7 @@ static int __pblk_rb_may_write(struct pblk_rb *rb, unsigned int nr_entries,
 static int pblk_rb_may_write(struct pblk_rb *rb, unsigned int nr_entries,
 			     unsigned int *pos)
 {
-	if (!__pblk_rb_may_write(rb, nr_entries, pos, true))
-		return 0;
-
-	/* Protect from read count */
-	smp_store_release(&rb->mem, (*pos + nr_entries) & (rb->nr_entries - 1));
-	return 1;
+	return __pblk_rb_may_write(rb, nr_entries, pos);
 }
 
 void pblk_rb_flush(struct pblk_rb *rb)
@@ -442,10 +820,10 @@ static int pblk_rb_may_write_flush(struct pblk_rb *rb, unsigned int nr_entries,
 {
 	unsigned int mem;
 
-	if (!__pblk_rb_may_write(rb, nr_entries, pos, false))
+	if (!__pblk_rb_may_write(rb, nr_entries, pos))
 		return 0;
 
-	//bookmark: get new rb->mem
+	//bookmark: end of the reserved range
 	mem = (*pos + nr_entries) & (rb->nr_entries - 1);
 	*io_ret = NVM_IO_DONE;
 
@@ -458,20 +836,19 @@ static int pblk_rb_may_write_flush(struct pblk_rb *rb, unsigned int nr_entries,
 		struct pblk *pblk = container_of(rb, struct pblk, rwb);
 
 		atomic64_inc(&pblk->nr_flush);
+		pblk_write_flush_arrival(pblk);
 		if (pblk_rb_flush_point_set(&pblk->rwb, bio, mem))
 			*io_ret = NVM_IO_OK;
 	}
 
-	/* Protect from read count */
-	smp_store_release(&rb->mem, mem);
-
 	return 1;
 }
 
 /*
- * Atomically check that (i) there is space on the write buffer for the
- * incoming I/O, and (ii) the current I/O type has enough budget in the write
- * buffer (rate-limiter).
+ * Check that (i) the current I/O type has enough budget in the write buffer
+ * (rate-limiter), and (ii) there is space on the write buffer for the incoming
+ * I/O. Both are claimed with atomic operations so that submitting CPUs do not
+ * serialize on a lock; the budget is given back if the buffer is full.
  */
 int pblk_rb_may_write_user(struct pblk_rb *rb, struct bio *bio,
 			   unsigned int nr_entries, unsigned int *pos)
@@ -479,20 +856,23 @@ int pblk_rb_may_write_user(struct pblk_rb *rb, struct bio *bio,
 	struct pblk *pblk = container_of(rb, struct pblk, rwb);
 	int io_ret;
 
-	spin_lock(&rb->w_lock);
-	io_ret = pblk_rl_user_may_insert(&pblk->rl, nr_entries);
-	if (io_ret) {
-		spin_unlock(&rb->w_lock);
-		return io_ret;
+	io_ret = pblk_rl_user_reserve(&pblk->rl, nr_entries);
+	if (io_ret == NVM_IO_REQUEUE) {
+		/* Budget is only given back when the l2p table is updated.
+		 * Do it for persisted entries before giving up
+		 */
+		pblk_rb_sync_l2p(rb);
+		io_ret = pblk_rl_user_reserve(&pblk->rl, nr_entries);
 	}
+	if (io_ret)
+		return io_ret;
 
 	if (!pblk_rb_may_write_flush(rb, nr_entries, pos, bio, &io_ret)) {
-		spin_unlock(&rb->w_lock);
+		pblk_rl_out(&pblk->rl, nr_entries, 0);
 		return NVM_IO_REQUEUE;
 	}
 
 	pblk_rl_user_in(&pblk->rl, nr_entries);
-	spin_unlock(&rb->w_lock);
 
 	return io_ret;
 }
@@ -505,33 +885,102 @@ int pblk_rb_may_write_gc(struct pblk_rb *rb, unsigned int nr_entries,
 {
 	struct pblk *pblk = container_of(rb, struct pblk, rwb);
 
-	spin_lock(&rb->w_lock);
-	if (!pblk_rl_gc_may_insert(&pblk->rl, nr_entries)) {
-		spin_unlock(&rb->w_lock);
-		return 0;
+	if (!pblk_rl_gc_reserve(&pblk->rl, nr_entries)) {
+		pblk_rb_sync_l2p(rb);
+		if (!pblk_rl_gc_reserve(&pblk->rl, nr_entries))
+			return 0;
 	}
 
 	if (!pblk_rb_may_write(rb, nr_entries, pos)) {
-		spin_unlock(&rb->w_lock);
+		pblk_rl_out(&pblk->rl, 0, nr_entries);
 		return 0;
 	}
 
-	pblk_rl_gc_in(&pblk->rl, nr_entries);
-	spin_unlock(&rb->w_lock);
-
 	return 1;
 }
 
+/*
+ * A pending flush that covers the entry at @pos must also cover the newer copy
+ * of its lba at @cacheline. Otherwise the flush would complete once the sync
+ * pointer passes @pos, with neither copy on the media.
+ */
+static bool pblk_rb_flush_allows_skip(struct pblk_rb *rb, unsigned int pos,
+				      unsigned int cacheline)
+{
+	unsigned int sync, flush_point, to_pos, to_point;
+	unsigned int seq;
+	bool allowed = true;
+
+	if (!pblk_rb_flush_pending(rb))
+		return true;
+
+	spin_lock_irq(&rb->s_lock);
+	sync = rb->sync;
+	to_pos = pblk_rb_ring_count(pos, sync, rb->nr_entries);
+
+	/* Only the oldest flush point at or after @pos matters; the ones
+	 * after it cover the newer copy as well
+	 */
+	for (seq = rb->flush_head; seq != rb->flush_tail; seq++) {
+		flush_point = *pblk_rb_flush_slot(rb, seq);
+		to_point = pblk_rb_ring_count(flush_point, sync, rb->nr_entries);
+		if (to_point < to_pos)
+			continue;
+
+		allowed = pblk_rb_ring_count(cacheline, sync,
+						rb->nr_entries) <= to_point;
+		break;
+	}
+	spin_unlock_irq(&rb->s_lock);
+
+	return allowed;
+}
+
+/*
+ * An entry is stale if its lba has been written again (or dropped by GC) after
+ * it was placed on the write buffer. Programming it would only produce an
+ * invalid sector on the media. An overwritten entry is still programmed if a
+ * pending flush would otherwise persist neither copy.
+ */
+static bool pblk_rb_entry_stale(struct pblk_rb *rb, struct pblk_rb_entry *entry,
+				unsigned int pos)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	sector_t lba = entry->w_ctx.lba;
+	struct ppa_addr l2p_ppa;
+
+	if (lba == ADDR_EMPTY)
+		return true;
+
+	l2p_ppa = pblk_trans_map_get(pblk, lba);
+	if (pblk_ppa_comp(l2p_ppa, entry->cacheline))
+		return false;
+
+	if (!pblk_addr_in_cache(l2p_ppa))
+		return true;
+
+	return pblk_rb_flush_allows_skip(rb, pos,
+					 pblk_addr_to_cacheline(l2p_ppa));
+}
+
 /*
  * Read available entries on rb and add them to the given bio. To avoid a memory
  * copy, a page reference to the write buffer is used to be added to the bio.
  *
+ * Up to @count entries are consumed starting at @pos, until @nr_entries of
+ * them have been added to the bio. Stale entries are consumed but not added
+ * (PBLK_SKIPPED_ENTRY), so overwritten sectors do not reach the media. If the
+ * request ends up short, it is padded to the minimum write size.
+ *
+ * With @split set, entries that belong on another open line than the one the
+ * request is mapped to end it early. Resubmitted requests are never split.
+ *
  * This function is used by the write thread to form the write bio that will
  * persist data on the write buffer to the media.
  */
 unsigned int pblk_rb_read_to_bio(struct pblk_rb *rb, struct nvm_rq *rqd,
 				 unsigned int pos, unsigned int nr_entries,
-				 unsigned int count)
+				 unsigned int count, bool split)
 {
 	struct pblk *pblk = container_of(rb, struct pblk, rwb);
 	struct request_queue *q = pblk->dev->q;
@@ -539,66 +988,92 @@ unsigned int pblk_rb_read_to_bio(struct pblk_rb *rb, struct nvm_rq *rqd,
 	struct bio *bio = rqd->bio;
 	struct pblk_rb_entry *entry;
 	struct page *page;
-	unsigned int pad = 0, to_read = nr_entries;
+	unsigned int min = pblk_get_min_write_pgs(pblk);
+	unsigned int pad = 0, valid = 0, skipped = 0;
 	unsigned int i;
+	int ret = NVM_IO_OK;
 	int flags;
 
-	if (count < nr_entries) {
-		pad = nr_entries - count;
-		to_read = count;
-	}
-
 	c_ctx->sentry = pos;
-	c_ctx->nr_valid = to_read;
-	c_ctx->nr_padded = pad;
+	c_ctx->nr_zc = 0;
 
-	for (i = 0; i < to_read; i++) {
+	for (i = 0; i < count && valid < nr_entries; i++) {
 		entry = &rb->entries[pos];
 
 		/* A write has been allowed into the buffer, but data is still
-		 * being copied to it. It is ok to busy wait.
+		 * being copied to it. The producer wakes us up when it is done
 		 */
-try:
+		wait_event(rb->written_wait,
+			READ_ONCE(entry->w_ctx.flags) & PBLK_WRITTEN_DATA);
 		flags = READ_ONCE(entry->w_ctx.flags);
-		if (!(flags & PBLK_WRITTEN_DATA)) {
-			io_schedule();
-			goto try;
+
+		flags &= ~PBLK_WRITTEN_DATA;
+		flags |= PBLK_SUBMITTED_ENTRY;
+
+		if (pblk_rb_entry_stale(rb, entry, pos)) {
+			/* Entries failing and being resubmitted were already
+			 * accounted for
+			 */
+			if (!(flags & PBLK_SKIPPED_ENTRY))
+				skipped++;
+			flags |= PBLK_SKIPPED_ENTRY;
+			/* Release flags on context. Protect from writes */
+			smp_store_release(&entry->w_ctx.flags, flags);
+
+			pos = (pos + 1) & (rb->nr_entries - 1);
+			continue;
 		}
+		flags &= ~PBLK_SKIPPED_ENTRY;
 
-		page = virt_to_page(entry->data);
+		/* The request is mapped to a single open line, which the
+		 * first entry picked (see pblk_write_stream_split)
+		 */
+		if (split && i && pblk_write_stream_split(pblk, &entry->w_ctx,
+						valid && !(valid % min)))
+			break;
+
+		if (flags & PBLK_ZC_ENTRY) {
+			page = virt_to_page(entry->zc_data);
+			c_ctx->nr_zc++;
+		} else {
+			page = virt_to_page(entry->data);
+		}
 		if (!page) {
 			pr_err("pblk: could not allocate write bio page\n");
-			flags &= ~PBLK_WRITTEN_DATA;
-			flags |= PBLK_SUBMITTED_ENTRY;
 			/* Release flags on context. Protect from writes */
 			smp_store_release(&entry->w_ctx.flags, flags);
-			return NVM_IO_ERR;
+			ret = NVM_IO_ERR;
+			i++;
+			goto out;
 		}
 
 		if (bio_add_pc_page(q, bio, page, rb->seg_size, 0) !=
 								rb->seg_size) {
 			pr_err("pblk: could not add page to write bio\n");
-			flags &= ~PBLK_WRITTEN_DATA;
-			flags |= PBLK_SUBMITTED_ENTRY;
 			/* Release flags on context. Protect from writes */
 			smp_store_release(&entry->w_ctx.flags, flags);
-			return NVM_IO_ERR;
+			ret = NVM_IO_ERR;
+			i++;
+			goto out;
 		}
 
-		flags &= ~PBLK_WRITTEN_DATA;
-		flags |= PBLK_SUBMITTED_ENTRY;
-
 		/* Release flags on context. Protect from writes */
 		//printk("ocssd[%s]: [%d] pos=%d, flags=0x%x\n", __func__, i, pos, flags);
 		smp_store_release(&entry->w_ctx.flags, flags);
 
+		valid++;
 		pos = (pos + 1) & (rb->nr_entries - 1);
 	}
 
+	if (valid < nr_entries && valid % min)
+		pad = min - (valid % min);
+
 	if (pad) {
-		if (pblk_bio_add_pages(pblk, bio, GFP_KERNEL, pad)) {
+		if (pblk_write_add_pad(pblk, rqd, pad)) {
 			pr_err("pblk: could not pad page in write bio\n");
-			return NVM_IO_ERR;
+			pad = 0;
+			ret = NVM_IO_ERR;
+			goto out;
 		}
 
 		if (pad < pblk->min_write_pgs)
@@ -607,13 +1082,22 @@ try:
 			pr_warn("pblk: padding more than min. sectors\n");
 
 		atomic64_add(pad, &pblk->pad_wa);
+		atomic64_add(pad, &pblk->stream_pad[pblk->l_mg.w_stream]);
 	}
 
+	if (skipped)
+		atomic64_add(skipped, &pblk->coalesced_wa);
+
 #ifdef CONFIG_NVM_DEBUG
 	atomic_long_add(pad, &pblk->padded_writes);
 #endif
 
-	return NVM_IO_OK;
+out:
+	c_ctx->nr_valid = i;
+	c_ctx->nr_skipped = i - valid;
+	c_ctx->nr_padded = pad;
+
+	return ret;
 }
 
 /*
@@ -633,6 +1117,23 @@ int pblk_rb_copy_to_bio(struct pblk_rb *rb, struct bio *bio, sector_t lba,
 	int flags;
 	int ret = 1;
 
+	/* Entries are only made writable under rb->w_lock, and producers do
+	 * not touch an entry until it is writable. Holding the lock keeps a
+	 * non-writable entry stable while it is copied. It also keeps the
+	 * buffer from being resized; a cacheline looked up before a resize
+	 * is not in the L2P table anymore and is read from the media.
+	 *
+	 * The L2P is read without trans_lock. Moving the mapping off an entry
+	 * and making the entry writable both happen under rb->w_lock, so a
+	 * mapping to @ppa seen here stays backed by the entry until we unlock
+	 */
+	spin_lock(&rb->w_lock);
+	l2p_ppa = pblk_trans_map_get(pblk, lba);
+
+	if (!pblk_ppa_comp(l2p_ppa, ppa)) {
+		ret = 0;
+		goto out;
+	}
 
 #ifdef CONFIG_NVM_DEBUG
 	/* Caller must ensure that the access will not cause an overflow */
@@ -642,14 +1143,8 @@ int pblk_rb_copy_to_bio(struct pblk_rb *rb, struct bio *bio, sector_t lba,
 	w_ctx = &entry->w_ctx;
 	flags = READ_ONCE(w_ctx->flags);
 
-	spin_lock(&rb->w_lock);
-	spin_lock(&pblk->trans_lock);
-	l2p_ppa = pblk_trans_map_get(pblk, lba);
-	spin_unlock(&pblk->trans_lock);
-
 	/* Check if the entry has been overwritten or is scheduled to be */
-	if (!pblk_ppa_comp(l2p_ppa, ppa) || w_ctx->lba != lba ||
-						flags & PBLK_WRITABLE_ENTRY) {
+	if (w_ctx->lba != lba || flags & PBLK_WRITABLE_ENTRY) {
 		ret = 0;
 		goto out;
 	}
@@ -663,7 +1158,8 @@ int pblk_rb_copy_to_bio(struct pblk_rb *rb, struct bio *bio, sector_t lba,
 		bio_advance(bio, bio_iter * PBLK_EXPOSED_PAGE_SIZE);
 
 	data = bio_data(bio);
-	memcpy(data, entry->data, rb->seg_size);
+	memcpy(data, entry->zc_data ? entry->zc_data : entry->data,
+							rb->seg_size);
 
 out:
 	spin_unlock(&rb->w_lock);
@@ -677,6 +1173,39 @@ struct pblk_w_ctx *pblk_rb_w_ctx(struct pblk_rb *rb, unsigned int pos)
 	return &rb->entries[entry].w_ctx;
 }
 
+/*
+ * Requests completing ahead of the sync pointer are parked on their first
+ * entry, so that the request that follows a sync advance is found without a
+ * search. The caller holds s_lock.
+ */
+void pblk_rb_compl_queue(struct pblk_rb *rb, struct pblk_c_ctx *c_ctx)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	struct pblk_rb_entry *entry = &rb->entries[c_ctx->sentry];
+
+	lockdep_assert_held(&rb->s_lock);
+
+	WARN_ON(entry->compl);
+	entry->compl = c_ctx;
+	pblk->compl_queued++;
+}
+
+struct pblk_c_ctx *pblk_rb_compl_pop(struct pblk_rb *rb, unsigned int pos)
+{
+	struct pblk *pblk = container_of(rb, struct pblk, rwb);
+	struct pblk_rb_entry *entry = &rb->entries[pos];
+	struct pblk_c_ctx *c_ctx = entry->compl;
+
+	lockdep_assert_held(&rb->s_lock);
+
+	if (c_ctx) {
+		entry->compl = NULL;
+		pblk->compl_queued--;
+	}
+
+	return c_ctx;
+}
+
 unsigned int pblk_rb_sync_init(struct pblk_rb *rb, unsigned long *flags)
 	__acquires(&rb->s_lock)
 {
@@ -705,17 +1234,20 @@ unsigned int pblk_rb_sync_advance(struct pblk_rb *rb, unsigned int nr_entries)
 	lockdep_assert_held(&rb->s_lock);
 
 	sync = READ_ONCE(rb->sync);
-	flush_point = READ_ONCE(rb->flush_point);
 
-	if (flush_point != EMPTY_ENTRY) {
+	/* Retire the flushes persisted by this advance. Their bios have been
+	 * completed with the entries they were queued on
+	 */
+	while (pblk_rb_flush_pending(rb)) {
 		unsigned int secs_to_flush;
 
+		flush_point = *pblk_rb_flush_slot(rb, rb->flush_head);
 		secs_to_flush = pblk_rb_ring_count(flush_point, sync,
 					rb->nr_entries);
-		if (secs_to_flush < nr_entries) {
-			/* Protect flush points */
-			smp_store_release(&rb->flush_point, EMPTY_ENTRY);
-		}
+		if (secs_to_flush >= nr_entries)
+			break;
+
+		WRITE_ONCE(rb->flush_head, rb->flush_head + 1);
 	}
 
 	sync = (sync + nr_entries) & (rb->nr_entries - 1);
@@ -723,30 +1255,44 @@ unsigned int pblk_rb_sync_advance(struct pblk_rb *rb, unsigned int nr_entries)
 	/* Protect from counts */
 	smp_store_release(&rb->sync, sync);
 
+	pblk_rb_wake_producers(rb);
+
 	return sync;
 }
 
-/* Calculate how many sectors to submit up to the current flush point. */
+/*
+ * Calculate how many sectors to submit up to the oldest flush point that has
+ * not been submitted yet.
+ */
 unsigned int pblk_rb_flush_point_count(struct pblk_rb *rb)
 {
 	unsigned int subm, sync, flush_point;
 	unsigned int submitted, to_flush;
+	unsigned int seq;
+	unsigned int ret = 0;
 
-	/* Protect flush points */
-	flush_point = smp_load_acquire(&rb->flush_point);
-	if (flush_point == EMPTY_ENTRY)
+	if (!pblk_rb_flush_pending(rb))
 		return 0;
 
-	/* Protect syncs */
-	sync = smp_load_acquire(&rb->sync);
-
+	spin_lock_irq(&rb->s_lock);
+	sync = rb->sync;
 	subm = READ_ONCE(rb->subm);
 	submitted = pblk_rb_ring_count(subm, sync, rb->nr_entries);
 
-	/* The sync point itself counts as a sector to sync */
-	to_flush = pblk_rb_ring_count(flush_point, sync, rb->nr_entries) + 1;
+	for (seq = rb->flush_head; seq != rb->flush_tail; seq++) {
+		flush_point = *pblk_rb_flush_slot(rb, seq);
 
-	return (submitted < to_flush) ? (to_flush - submitted) : 0;
+		/* The sync point itself counts as a sector to sync */
+		to_flush = pblk_rb_ring_count(flush_point, sync,
+						rb->nr_entries) + 1;
+		if (submitted < to_flush) {
+			ret = to_flush - submitted;
+			break;
+		}
+	}
+	spin_unlock_irq(&rb->s_lock);
+
+	return ret;
 }
 
 /*
@@ -786,7 +1332,7 @@ int pblk_rb_tear_down_check(struct pblk_rb *rb)
 
 	if ((rb->mem == rb->subm) && (rb->subm == rb->sync) &&
 				(rb->sync == rb->l2p_update) &&
-				(rb->flush_point == EMPTY_ENTRY)) {
+				!pblk_rb_flush_pending(rb)) {
 		goto out;
 	}
 
@@ -824,16 +1370,10 @@ int pblk_rb_pos_oob(struct pblk_rb *rb, u64 pos)
 ssize_t pblk_rb_sysfs(struct pblk_rb *rb, char *buf)
 {
 	struct pblk *pblk = container_of(rb, struct pblk, rwb);
-	struct pblk_c_ctx *c;
 	ssize_t offset;
-	int queued_entries = 0;
-
-	spin_lock_irq(&rb->s_lock);
-	list_for_each_entry(c, &pblk->compl_list, list)
-		queued_entries++;
-	spin_unlock_irq(&rb->s_lock);
+	int queued_entries = READ_ONCE(pblk->compl_queued);
 
-	if (rb->flush_point != EMPTY_ENTRY)
+	if (pblk_rb_flush_pending(rb))
 		offset = scnprintf(buf, PAGE_SIZE,
 			"%u\t%u\t%u\t%u\t%u\t%u\t%u - %u/%u/%u - %d\n",
 			rb->nr_entries,
@@ -846,7 +1386,8 @@ ssize_t pblk_rb_sysfs(struct pblk_rb *rb, char *buf)
 #else
 			0,
 #endif
-			rb->flush_point,
+			READ_ONCE(*pblk_rb_flush_slot(rb,
+					READ_ONCE(rb->flush_tail) - 1)),
 			pblk_rb_read_count(rb),
 			pblk_rb_space(rb),
 			pblk_rb_flush_point_count(rb),
@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2016 CNEX Labs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * pblk-rcache.c - pblk's read cache for clean media pages
+ *
+ */
+
+#include <linux/hash.h>
+
+#include "pblk.h"
+
+struct pblk_rc_entry {
+	struct hlist_node node;
+	struct list_head list;		/* Position on its queue */
+	sector_t lba;
+	struct ppa_addr ppa;		/* Address the page was read from */
+	struct page *page;		/* NULL on the a1out ghost list */
+	unsigned int queue;
+	bool ra;			/* Prefetched and not read yet */
+};
+
+static const char * const pblk_rc_policies[PBLK_RC_NR_POLICIES] = {
+	[PBLK_RC_LRU]	= "lru",
+	[PBLK_RC_2Q]	= "2q",
+};
+
+const char *pblk_rcache_policy_name(unsigned int policy)
+{
+	return pblk_rc_policies[policy];
+}
+
+static struct hlist_head *pblk_rc_bucket(struct pblk_rcache *rc,
+					 sector_t lba)
+{
+	return &rc->hash[hash_64(lba, rc->hash_bits)];
+}
+
+/*
+ * All functions below that take a struct pblk_rcache are called with
+ * rc->lock held.
+ */
+static struct pblk_rc_entry *pblk_rc_find(struct pblk_rcache *rc,
+					  sector_t lba)
+{
+	struct pblk_rc_entry *entry;
+
+	hlist_for_each_entry(entry, pblk_rc_bucket(rc, lba), node)
+		if (entry->lba == lba)
+			return entry;
+
+	return NULL;
+}
+
+static void pblk_rc_queue(struct pblk_rcache *rc, struct pblk_rc_entry *entry,
+			  unsigned int queue)
+{
+	list_add(&entry->list, &rc->queue[queue]);
+	entry->queue = queue;
+	rc->q_len[queue]++;
+}
+
+static void pblk_rc_dequeue(struct pblk_rcache *rc,
+			    struct pblk_rc_entry *entry)
+{
+	list_del(&entry->list);
+	rc->q_len[entry->queue]--;
+}
+
+static void pblk_rc_put_page(struct pblk_rcache *rc,
+			     struct pblk_rc_entry *entry)
+{
+	atomic_dec(&rc->nr_pages);
+
+	if (entry->ra)
+		atomic64_inc(&rc->ra_waste);
+	entry->ra = false;
+
+	put_page(entry->page);
+	entry->page = NULL;
+}
+
+static void pblk_rc_drop(struct pblk_rcache *rc, struct pblk_rc_entry *entry)
+{
+	hlist_del(&entry->node);
+	pblk_rc_dequeue(rc, entry);
+
+	if (entry->page)
+		pblk_rc_put_page(rc, entry);
+
+	kfree(entry);
+}
+
+static struct pblk_rc_entry *pblk_rc_tail(struct pblk_rcache *rc,
+					  unsigned int queue)
+{
+	return list_last_entry(&rc->queue[queue], struct pblk_rc_entry, list);
+}
+
+/* The a1out ghost list remembers half as many lbas as the cache holds */
+static void pblk_rc_trim_ghosts(struct pblk_rcache *rc)
+{
+	while (rc->q_len[PBLK_RC_A1OUT] > rc->max_pages / 2)
+		pblk_rc_drop(rc, pblk_rc_tail(rc, PBLK_RC_A1OUT));
+}
+
+/*
+ * Evict one page. 2Q takes it from a1in while a1in holds more than its share
+ * of the cache, and keeps the lba on a1out. LRU takes it from am, unless pages
+ * are left on a1in from a previous 2Q run.
+ */
+static void pblk_rc_evict(struct pblk_rcache *rc)
+{
+	struct pblk_rc_entry *entry;
+
+	if (list_empty(&rc->queue[PBLK_RC_A1IN]) ||
+			(rc->policy == PBLK_RC_2Q &&
+			 rc->q_len[PBLK_RC_A1IN] <= rc->max_pages / 4 &&
+			 !list_empty(&rc->queue[PBLK_RC_AM]))) {
+		pblk_rc_drop(rc, pblk_rc_tail(rc, PBLK_RC_AM));
+		return;
+	}
+
+	entry = pblk_rc_tail(rc, PBLK_RC_A1IN);
+	if (rc->policy != PBLK_RC_2Q) {
+		pblk_rc_drop(rc, entry);
+		return;
+	}
+
+	pblk_rc_put_page(rc, entry);
+	pblk_rc_dequeue(rc, entry);
+	pblk_rc_queue(rc, entry, PBLK_RC_A1OUT);
+	pblk_rc_trim_ghosts(rc);
+}
+
+/*
+ * Insert the page holding @lba as stored at @ppa, as long as the L2P table
+ * still maps @lba to @map; the cache takes the page reference on success. May
+ * be called from completion context.
+ *
+ * Writers remap the lba first and then look for an entry to drop (see
+ * pblk_rcache_invalidate()). Counting the page before checking the mapping
+ * makes sure that data remapped while it was being read is either refused
+ * here or seen and dropped by the writer.
+ */
+static bool __pblk_rcache_insert(struct pblk *pblk, sector_t lba,
+				 struct ppa_addr ppa, struct ppa_addr map,
+				 struct page *page, int src)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_rc_entry *entry, *old;
+	unsigned int queue;
+	unsigned long flags;
+
+	entry = kmalloc(sizeof(struct pblk_rc_entry),
+						GFP_NOWAIT | __GFP_NOWARN);
+	if (!entry)
+		return false;
+
+	entry->lba = lba;
+	entry->ppa = ppa;
+	entry->page = page;
+	entry->ra = (src == PBLK_RC_SRC_RA);
+
+	spin_lock_irqsave(&rc->lock, flags);
+	atomic_inc(&rc->nr_pages);
+	smp_mb__after_atomic();
+
+	if (!rc->max_pages ||
+			!pblk_ppa_comp(pblk_trans_map_get(pblk, lba), map)) {
+		atomic_dec(&rc->nr_pages);
+		spin_unlock_irqrestore(&rc->lock, flags);
+		kfree(entry);
+		return false;
+	}
+
+	queue = (rc->policy == PBLK_RC_2Q) ? PBLK_RC_A1IN : PBLK_RC_AM;
+
+	old = pblk_rc_find(rc, lba);
+	if (old) {
+		/* Refills of lbas remembered by 2Q, and of hot pages, are hot */
+		if (old->queue == PBLK_RC_A1OUT) {
+			if (rc->policy == PBLK_RC_2Q) {
+				atomic64_inc(&rc->q_hits[PBLK_RC_A1OUT]);
+				queue = PBLK_RC_AM;
+			}
+		} else if (old->queue == PBLK_RC_AM) {
+			queue = PBLK_RC_AM;
+		}
+		pblk_rc_drop(rc, old);
+	}
+
+	hlist_add_head(&entry->node, pblk_rc_bucket(rc, lba));
+	pblk_rc_queue(rc, entry, queue);
+	atomic64_inc(&rc->fills[src]);
+
+	while (atomic_read(&rc->nr_pages) > rc->max_pages)
+		pblk_rc_evict(rc);
+	spin_unlock_irqrestore(&rc->lock, flags);
+
+	return true;
+}
+
+/* Insert the page holding @lba as read from @ppa */
+bool pblk_rcache_insert(struct pblk *pblk, sector_t lba, struct ppa_addr ppa,
+			struct page *page, int src)
+{
+	return __pblk_rcache_insert(pblk, lba, ppa, ppa, page, src);
+}
+
+/*
+ * Copy @data into a new page and cache it. Pages are not worth waiting for,
+ * so nothing is cached under memory pressure. Data still on the write buffer
+ * is mapped to its cacheline, which is passed as @map; otherwise @map is @ppa.
+ */
+void pblk_rcache_fill(struct pblk *pblk, sector_t lba, struct ppa_addr ppa,
+		      struct ppa_addr map, void *data, int src)
+{
+	struct page *page;
+
+	page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+	if (!page)
+		return;
+
+	memcpy(page_address(page), data, PBLK_EXPOSED_PAGE_SIZE);
+
+	if (!__pblk_rcache_insert(pblk, lba, ppa, map, page, src))
+		__free_page(page);
+}
+
+bool pblk_rcache_cached(struct pblk *pblk, sector_t lba, struct ppa_addr ppa)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_rc_entry *entry;
+	unsigned long flags;
+	bool cached;
+
+	if (!atomic_read(&rc->nr_pages))
+		return false;
+
+	spin_lock_irqsave(&rc->lock, flags);
+	entry = pblk_rc_find(rc, lba);
+	cached = entry && entry->page && pblk_ppa_comp(entry->ppa, ppa);
+	spin_unlock_irqrestore(&rc->lock, flags);
+
+	return cached;
+}
+
+/*
+ * Copy @lba to the bio if it is cached as read from @ppa, which the caller
+ * looked up on the L2P table. The page is copied outside of the lock; an
+ * entry dropped meanwhile still holds the data @ppa was mapped to.
+ */
+bool pblk_rcache_read(struct pblk *pblk, struct bio *bio, sector_t lba,
+		      struct ppa_addr ppa, int bio_iter, bool advanced_bio)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_rc_entry *entry;
+	struct page *page;
+	unsigned long flags;
+
+	if (!READ_ONCE(rc->max_pages))
+		return false;
+
+	atomic64_inc(&rc->lookups[READ_ONCE(rc->policy)]);
+	if (!atomic_read(&rc->nr_pages))
+		return false;
+
+	spin_lock_irqsave(&rc->lock, flags);
+
+	entry = pblk_rc_find(rc, lba);
+	if (!entry || !entry->page || !pblk_ppa_comp(entry->ppa, ppa)) {
+		spin_unlock_irqrestore(&rc->lock, flags);
+		return false;
+	}
+
+	atomic64_inc(&rc->hits[rc->policy]);
+	atomic64_inc(&rc->q_hits[entry->queue]);
+
+	if (entry->ra) {
+		entry->ra = false;
+		atomic64_inc(&rc->ra_hits);
+	}
+
+	/* 2Q leaves a1in in insertion order, so that a page read once is
+	 * evicted before pages read over and over
+	 */
+	if (rc->policy != PBLK_RC_2Q || entry->queue == PBLK_RC_AM) {
+		pblk_rc_dequeue(rc, entry);
+		pblk_rc_queue(rc, entry, PBLK_RC_AM);
+	}
+
+	page = entry->page;
+	get_page(page);
+	spin_unlock_irqrestore(&rc->lock, flags);
+
+	/* See pblk_rb_copy_to_bio() */
+	if (unlikely(!advanced_bio))
+		bio_advance(bio, bio_iter * PBLK_EXPOSED_PAGE_SIZE);
+
+	memcpy(bio_data(bio), page_address(page), PBLK_EXPOSED_PAGE_SIZE);
+	put_page(page);
+
+	return true;
+}
+
+/*
+ * Drop the pages of a remapped range. Callers update the L2P table first;
+ * the barrier pairs with the one in pblk_rcache_insert(). Lbas on the ghost
+ * list stay, since they record accesses rather than data.
+ */
+void pblk_rcache_invalidate(struct pblk *pblk, sector_t slba,
+			    unsigned int nr_secs)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_rc_entry *entry, *next;
+	unsigned long flags;
+	sector_t lba;
+	int queue;
+
+	smp_mb();
+	if (!atomic_read(&rc->nr_pages))
+		return;
+
+	spin_lock_irqsave(&rc->lock, flags);
+
+	/* Large discards are cheaper to match against the cache contents */
+	if (nr_secs > atomic_read(&rc->nr_pages)) {
+		for (queue = PBLK_RC_A1IN; queue <= PBLK_RC_AM; queue++)
+			list_for_each_entry_safe(entry, next,
+						&rc->queue[queue], list)
+				if (entry->lba >= slba &&
+						entry->lba < slba + nr_secs)
+					pblk_rc_drop(rc, entry);
+		goto out;
+	}
+
+	for (lba = slba; lba < slba + nr_secs; lba++) {
+		entry = pblk_rc_find(rc, lba);
+		if (entry && entry->page)
+			pblk_rc_drop(rc, entry);
+	}
+
+out:
+	spin_unlock_irqrestore(&rc->lock, flags);
+}
+
+void pblk_rcache_resize(struct pblk *pblk, unsigned int max_pages)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+
+	spin_lock_irq(&rc->lock);
+	rc->max_pages = max_pages;
+	while (atomic_read(&rc->nr_pages) > rc->max_pages)
+		pblk_rc_evict(rc);
+	pblk_rc_trim_ghosts(rc);
+	spin_unlock_irq(&rc->lock);
+}
+
+void pblk_rcache_set_policy(struct pblk *pblk, unsigned int policy)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_rc_entry *entry, *next;
+
+	spin_lock_irq(&rc->lock);
+	rc->policy = policy;
+
+	/* LRU has no use for the ghosts */
+	if (policy != PBLK_RC_2Q)
+		list_for_each_entry_safe(entry, next,
+					&rc->queue[PBLK_RC_A1OUT], list)
+			pblk_rc_drop(rc, entry);
+	spin_unlock_irq(&rc->lock);
+}
+
+static unsigned long pblk_rcache_shrink_count(struct shrinker *shrinker,
+					      struct shrink_control *sc)
+{
+	struct pblk *pblk = container_of(shrinker, struct pblk, rc.shrinker);
+
+	return atomic_read(&pblk->rc.nr_pages);
+}
+
+static unsigned long pblk_rcache_shrink_scan(struct shrinker *shrinker,
+					     struct shrink_control *sc)
+{
+	struct pblk *pblk = container_of(shrinker, struct pblk, rc.shrinker);
+	struct pblk_rcache *rc = &pblk->rc;
+	unsigned long freed = 0;
+
+	spin_lock_irq(&rc->lock);
+	while (freed < sc->nr_to_scan && atomic_read(&rc->nr_pages)) {
+		pblk_rc_evict(rc);
+		freed++;
+	}
+	spin_unlock_irq(&rc->lock);
+
+	if (!freed)
+		return SHRINK_STOP;
+
+	atomic64_add(freed, &rc->shrunk);
+	return freed;
+}
+
+int pblk_rcache_init(struct pblk *pblk)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	int ret, i;
+
+	/* Chains hold 16 pages on average with the cache at its largest */
+	rc->hash_bits = ilog2(PBLK_RC_MAX_PAGES) - 4;
+	rc->hash = vzalloc((1 << rc->hash_bits) * sizeof(struct hlist_head));
+	if (!rc->hash)
+		return -ENOMEM;
+
+	spin_lock_init(&rc->lock);
+	for (i = 0; i < PBLK_RC_NR_QUEUES; i++) {
+		INIT_LIST_HEAD(&rc->queue[i]);
+		rc->q_len[i] = 0;
+		atomic64_set(&rc->q_hits[i], 0);
+	}
+
+	/* The cache and readahead stay off until sized from sysfs */
+	atomic_set(&rc->nr_pages, 0);
+	rc->max_pages = 0;
+	rc->policy = PBLK_RC_2Q;
+	rc->fill = PBLK_RC_FILL_READ;
+
+	for (i = 0; i < PBLK_RC_NR_POLICIES; i++) {
+		atomic64_set(&rc->lookups[i], 0);
+		atomic64_set(&rc->hits[i], 0);
+	}
+	for (i = 0; i < PBLK_RC_NR_SRCS; i++)
+		atomic64_set(&rc->fills[i], 0);
+	atomic64_set(&rc->shrunk, 0);
+
+	spin_lock_init(&rc->ra_lock);
+	for (i = 0; i < PBLK_RA_STREAMS; i++) {
+		rc->streams[i].next_lba = ADDR_EMPTY;
+		rc->streams[i].ra_lba = 0;
+		rc->streams[i].nr_reads = 0;
+		rc->streams[i].stamp = jiffies;
+	}
+
+	rc->ra_secs = 0;
+	atomic_set(&rc->ra_inflight, 0);
+	init_waitqueue_head(&rc->ra_wait);
+	atomic64_set(&rc->ra_issued, 0);
+	atomic64_set(&rc->ra_hits, 0);
+	atomic64_set(&rc->ra_waste, 0);
+
+	/* Pages are expensive to read again from TLC, ask to be shrunk less */
+	rc->shrinker.count_objects = pblk_rcache_shrink_count;
+	rc->shrinker.scan_objects = pblk_rcache_shrink_scan;
+	rc->shrinker.seeks = DEFAULT_SEEKS * 2;
+	ret = register_shrinker(&rc->shrinker);
+	if (ret) {
+		vfree(rc->hash);
+		return ret;
+	}
+
+	return 0;
+}
+
+void pblk_rcache_free(struct pblk *pblk)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_rc_entry *entry, *next;
+	int i;
+
+	unregister_shrinker(&rc->shrinker);
+
+	/* Readahead completions insert pages and put line references */
+	wait_event(rc->ra_wait, !atomic_read(&rc->ra_inflight));
+
+	spin_lock_irq(&rc->lock);
+	for (i = 0; i < PBLK_RC_NR_QUEUES; i++)
+		list_for_each_entry_safe(entry, next, &rc->queue[i], list)
+			pblk_rc_drop(rc, entry);
+	spin_unlock_irq(&rc->lock);
+
+	vfree(rc->hash);
+}
@@ -43,6 +43,7 @@ static void pblk_read_ppalist_rq(struct pblk *pblk, struct nvm_rq *rqd,
 				 unsigned long *read_bitmap)
 {
 	struct pblk_sec_meta *meta_list = rqd->meta_list;
+	struct pblk_line_refs refs = PBLK_LINE_REFS_INIT;
 	struct ppa_addr ppas[PBLK_MAX_REQ_ADDRS];
 	int nr_secs = rqd->nr_ppas;
 	bool advanced_bio = false;
@@ -82,6 +83,16 @@ retry:
 #ifdef CONFIG_NVM_DEBUG
 			atomic_long_inc(&pblk->cache_reads);
 #endif
+		} else if (pblk_rcache_read(pblk, bio, lba, p, i,
+							advanced_bio)) {
+			WARN_ON(test_and_set_bit(i, read_bitmap));
+			meta_list[i].lba = cpu_to_le64(lba);
+			advanced_bio = true;
+
+			/* The sector is not read from its line */
+			pblk_line_refs_put(&refs,
+					&pblk->lines[pblk_ppa_to_line(p)],
+					pblk_line_put_wq);
 		} else {
 			/* Read from media non-cached sectors */
 			rqd->ppa_list[j++] = p;
@@ -91,6 +102,7 @@ next:
 		if (advanced_bio)
 			bio_advance(bio, PBLK_EXPOSED_PAGE_SIZE);
 	}
+	pblk_line_refs_put_flush(&refs, pblk_line_put_wq);
 
 	if (pblk_io_aligned(pblk, nr_secs))
 		rqd->flags = pblk_set_read_mode(pblk, PBLK_READ_SEQUENTIAL);
@@ -171,6 +183,7 @@ static void pblk_read_check_rand(struct pblk *pblk, struct nvm_rq *rqd,
 
 static void pblk_read_put_rqd_kref(struct pblk *pblk, struct nvm_rq *rqd)
 {
+	struct pblk_line_refs refs = PBLK_LINE_REFS_INIT;
 	struct ppa_addr *ppa_list;
 	int i;
 
@@ -183,8 +196,9 @@ static void pblk_read_put_rqd_kref(struct pblk *pblk, struct nvm_rq *rqd)
 		line = &pblk->lines[pblk_ppa_to_line(ppa)];
 		//print_ppa(&pblk->dev->geo, &ppa, "read_kref", i);
 		//bookmark: 如果执行了kref_get，则会触发put_wq
-		kref_put(&line->ref, pblk_line_put_wq);
+		pblk_line_refs_put(&refs, line, pblk_line_put_wq);
 	}
+	pblk_line_refs_put_flush(&refs, pblk_line_put_wq);
 }
 
 static void pblk_end_user_read(struct bio *bio)
@@ -232,6 +246,41 @@ static void __pblk_end_io_read(struct pblk *pblk, struct nvm_rq *rqd, bool put_l
 	atomic_dec(&pblk->inflight_io);
 }
 
+/*
+ * Keep the sectors of a plain media read in the read cache. Reads served
+ * partially by the caches are not kept: their holes are not recorded. The
+ * original bio has not been advanced, unlike the clone the device completed.
+ */
+static void pblk_read_fill_cache(struct pblk *pblk, struct nvm_rq *rqd,
+				 struct bio *bio)
+{
+	struct pblk_g_ctx *r_ctx = nvm_rq_to_pdu(rqd);
+	struct bvec_iter iter = bio->bi_iter;
+	struct ppa_addr *ppa_list;
+	struct bio_vec bv;
+	void *data;
+	int i;
+
+	if (rqd->error || !rqd->bio || !bio_flagged(rqd->bio, BIO_CLONED))
+		return;
+
+	if (!(READ_ONCE(pblk->rc.fill) & PBLK_RC_FILL_READ) ||
+					!READ_ONCE(pblk->rc.max_pages))
+		return;
+
+	ppa_list = (rqd->nr_ppas > 1) ? rqd->ppa_list : &rqd->ppa_addr;
+
+	for (i = 0; i < rqd->nr_ppas; i++) {
+		bv = bio_iter_iovec(bio, iter);
+		bio_advance_iter(bio, &iter, PBLK_EXPOSED_PAGE_SIZE);
+
+		data = kmap_atomic(bv.bv_page);
+		pblk_rcache_fill(pblk, r_ctx->lba + i, ppa_list[i], ppa_list[i],
+				data + bv.bv_offset, PBLK_RC_SRC_READ);
+		kunmap_atomic(data);
+	}
+}
+
 static void pblk_end_io_read(struct nvm_rq *rqd)
 {
 	struct pblk *pblk = rqd->private;
@@ -241,135 +290,74 @@ static void pblk_end_io_read(struct nvm_rq *rqd)
 	//uint16_t *tmp = bio_data(bio);
 	//printk("r_io: lba=%lld, dat=0x%04x\n", r_ctx->lba, *tmp);
 	WARN_ON(bio == NULL);
+	pblk_read_fill_cache(pblk, rqd, bio);
 	pblk_end_user_read(bio);
 	__pblk_end_io_read(pblk, rqd, true);
 }
 
+/*
+ * The read bio is partially filled by the write buffer. The holes are read
+ * from the media straight into the pages of the original bio, through an
+ * internal bio pointing to them, and the request completes asynchronously as
+ * a plain media read. @bio_init_iter is the position of the original bio
+ * before the cached sectors were copied to it.
+ */
 static int pblk_partial_read(struct pblk *pblk, struct nvm_rq *rqd,
-			     struct bio *orig_bio, unsigned int bio_init_idx,
+			     struct bio *orig_bio, struct bvec_iter bio_init_iter,
 			     unsigned long *read_bitmap)
 {
-	struct pblk_sec_meta *meta_list = rqd->meta_list;
-	struct bio *new_bio;
-	struct bio_vec src_bv, dst_bv;
-	void *ppa_ptr = NULL;
-	void *src_p, *dst_p;
-	dma_addr_t dma_ppa_list = 0;
-	__le64 *lba_list_mem, *lba_list_media;
+	struct request_queue *q = pblk->dev->q;
+	struct bvec_iter iter = bio_init_iter;
+	struct bio *int_bio;
+	struct bio_vec bv;
 	int nr_secs = rqd->nr_ppas;
 	int nr_holes = nr_secs - bitmap_weight(read_bitmap, nr_secs);
-	int i, ret, hole;
-
-	/* Re-use allocated memory for intermediate lbas */
-	lba_list_mem = (((void *)rqd->ppa_list) + pblk_dma_ppa_size);
-	lba_list_media = (((void *)rqd->ppa_list) + 2 * pblk_dma_ppa_size);
-
-	new_bio = bio_alloc(GFP_KERNEL, nr_holes);
-
-	if (pblk_bio_add_pages(pblk, new_bio, GFP_KERNEL, nr_holes))
-		goto fail_add_pages;
-
-	if (nr_holes != new_bio->bi_vcnt) {
-		pr_err("pblk: malformed bio\n");
-		goto fail;
-	}
-
-	for (i = 0; i < nr_secs; i++)
-		lba_list_mem[i] = meta_list[i].lba;
-
-	new_bio->bi_iter.bi_sector = 0; /* internal bio */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-#else
-	bio_set_op_attrs(new_bio, REQ_OP_READ, 0);
-#endif
+	int i;
 
-	rqd->bio = new_bio;
+	/* Only the holes were looked up on the media, in order */
 	rqd->nr_ppas = nr_holes;
 	rqd->flags = pblk_set_read_mode(pblk, PBLK_READ_RANDOM);
-
-	if (unlikely(nr_holes == 1)) {
-		ppa_ptr = rqd->ppa_list;
-		dma_ppa_list = rqd->dma_ppa_list;
+	if (unlikely(nr_holes == 1))
 		rqd->ppa_addr = rqd->ppa_list[0];
-	}
 
-	printk("ocssd[%s]: nr_ppas=%d\n", __func__, rqd->nr_ppas);
-	ret = pblk_submit_io_sync(pblk, rqd);
-	if (ret) {
-		bio_put(rqd->bio);
-		pr_err("pblk: sync read IO submission failed\n");
+	int_bio = bio_alloc(GFP_KERNEL, nr_holes);
+	if (!int_bio)
 		goto fail;
-	}
-
-	if (rqd->error) {
-		atomic_long_inc(&pblk->read_failed);
-#ifdef CONFIG_NVM_DEBUG
-		pblk_print_failed_rqd(pblk, rqd, rqd->error);
-#endif
-	}
-
-	if (unlikely(nr_holes == 1)) {
-		struct ppa_addr ppa;
-
-		ppa = rqd->ppa_addr;
-		rqd->ppa_list = ppa_ptr;
-		rqd->dma_ppa_list = dma_ppa_list;
-		rqd->ppa_list[0] = ppa;
-	}
 
 	for (i = 0; i < nr_secs; i++) {
-		lba_list_media[i] = meta_list[i].lba;
-		meta_list[i].lba = lba_list_mem[i];
-	}
-
-	/* Fill the holes in the original bio */
-	i = 0;
-	hole = find_first_zero_bit(read_bitmap, nr_secs);
-	do {
-		int line_id = pblk_ppa_to_line(rqd->ppa_list[i]);
-		struct pblk_line *line = &pblk->lines[line_id];
-
-		kref_put(&line->ref, pblk_line_put);
-
-		meta_list[hole].lba = lba_list_media[i];
-
-		src_bv = new_bio->bi_io_vec[i++];
-		dst_bv = orig_bio->bi_io_vec[bio_init_idx + hole];
-
-		src_p = kmap_atomic(src_bv.bv_page);
-		dst_p = kmap_atomic(dst_bv.bv_page);
+		bv = bio_iter_iovec(orig_bio, iter);
+		bio_advance_iter(orig_bio, &iter, PBLK_EXPOSED_PAGE_SIZE);
 
-		memcpy(dst_p + dst_bv.bv_offset,
-			src_p + src_bv.bv_offset,
-			PBLK_EXPOSED_PAGE_SIZE);
+		if (test_bit(i, read_bitmap))
+			continue;
 
-		kunmap_atomic(src_p);
-		kunmap_atomic(dst_p);
+		if (bio_add_pc_page(q, int_bio, bv.bv_page,
+				PBLK_EXPOSED_PAGE_SIZE, bv.bv_offset) !=
+						PBLK_EXPOSED_PAGE_SIZE) {
+			pr_err("pblk: could not add page to partial read bio\n");
+			bio_put(int_bio);
+			goto fail;
+		}
+	}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-		mempool_free(src_bv.bv_page, pblk->page_bio_pool);
-#else
-		mempool_free(src_bv.bv_page, &pblk->page_bio_pool);
+	int_bio->bi_iter.bi_sector = 0; /* internal bio */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+	bio_set_op_attrs(int_bio, REQ_OP_READ, 0);
 #endif
+	rqd->bio = int_bio;
 
-		hole = find_next_zero_bit(read_bitmap, nr_secs, hole + 1);
-	} while (hole < nr_secs);
-
-	bio_put(new_bio);
-
-	/* restore original request */
-	rqd->bio = NULL;
-	rqd->nr_ppas = nr_secs;
+	if (pblk_submit_io(pblk, rqd)) {
+		pr_err("pblk: partial read IO submission failed\n");
+		__pblk_end_io_read(pblk, rqd, true);
+		return NVM_IO_ERR;
+	}
 
-	__pblk_end_io_read(pblk, rqd, false);
-	return NVM_IO_DONE;
+	return NVM_IO_OK;
 
 fail:
-	/* Free allocated pages in new bio */
-	pblk_bio_free_pages(pblk, new_bio, 0, new_bio->bi_vcnt);
-fail_add_pages:
 	pr_err("pblk: failed to perform partial read\n");
-	__pblk_end_io_read(pblk, rqd, false);
+	atomic_inc(&pblk->inflight_io);
+	__pblk_end_io_read(pblk, rqd, true);
 	return NVM_IO_ERR;
 }
 
@@ -408,6 +396,13 @@ retry:
 #ifdef CONFIG_NVM_DEBUG
 		atomic_long_inc(&pblk->cache_reads);
 #endif
+	} else if (pblk_rcache_read(pblk, bio, lba, ppa, 0, 1)) {
+		WARN_ON(test_and_set_bit(0, read_bitmap));
+		meta_list[0].lba = cpu_to_le64(lba);
+		rqd->ppa_addr = ppa;
+
+		pblk_line_ref_put(&pblk->lines[pblk_ppa_to_line(ppa)], 1,
+							pblk_line_put_wq);
 	} else {
 		rqd->ppa_addr = ppa;
 	}
@@ -425,7 +420,7 @@ int pblk_submit_read(struct pblk *pblk, struct bio *bio)
 	unsigned int nr_secs = pblk_get_secs(bio);
 	struct pblk_g_ctx *r_ctx;
 	struct nvm_rq *rqd;
-	unsigned int bio_init_idx;
+	struct bvec_iter bio_init_iter;
 	unsigned long read_bitmap; /* Max 64 ppas per request */
 	int ret = NVM_IO_ERR;
 
@@ -458,10 +453,10 @@ int pblk_submit_read(struct pblk *pblk, struct bio *bio)
 	r_ctx->lba = blba;
 	r_ctx->private = bio; /* original bio */
 
-	/* Save the index for this bio's start. This is needed in case
+	/* Save the position of this bio's start. This is needed in case
 	 * we need to fill a partial read.
 	 */
-	bio_init_idx = pblk_get_bi_idx(bio);
+	bio_init_iter = bio->bi_iter;
 
 	rqd->meta_list = pblk_dev_dma_alloc(dev->parent, GFP_KERNEL,
 							&rqd->dma_meta_list);
@@ -535,7 +530,7 @@ int pblk_submit_read(struct pblk *pblk, struct bio *bio)
 	/* The read bio request could be partially filled by the write buffer,
 	 * but there are some holes that need to be read from the drive.
 	 */
-	return pblk_partial_read(pblk, rqd, bio, bio_init_idx, &read_bitmap);
+	return pblk_partial_read(pblk, rqd, bio, bio_init_iter, &read_bitmap);
 
 fail_rqd_free:
 	pblk_free_rqd(pblk, rqd, PBLK_READ);
@@ -545,6 +540,257 @@ fail_end_io:
 	return ret;
 }
 
+static void __pblk_end_io_ra(struct pblk *pblk, struct nvm_rq *rqd)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_g_ctx *r_ctx = nvm_rq_to_pdu(rqd);
+	struct bio *bio = rqd->bio;
+	struct ppa_addr *ppa_list;
+	int i;
+
+	ppa_list = (rqd->nr_ppas > 1) ? rqd->ppa_list : &rqd->ppa_addr;
+
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		struct page *page = bio->bi_io_vec[i].bv_page;
+
+		if (rqd->error || !pblk_rcache_insert(pblk, r_ctx->lba + i,
+					ppa_list[i], page, PBLK_RC_SRC_RA)) {
+			atomic64_inc(&rc->ra_waste);
+			__free_page(page);
+		}
+	}
+
+	bio_put(bio);
+	pblk_read_put_rqd_kref(pblk, rqd);
+	pblk_free_rqd(pblk, rqd, PBLK_READ);
+
+	atomic_dec(&pblk->inflight_io);
+	if (atomic_dec_and_test(&rc->ra_inflight))
+		wake_up(&rc->ra_wait);
+}
+
+static void pblk_end_io_ra(struct nvm_rq *rqd)
+{
+	__pblk_end_io_ra(rqd->private, rqd);
+}
+
+/*
+ * Prefetch the leading physical run of [blba, blba + nr_secs) into the read
+ * cache. Sectors that are not mapped, sit on the write buffer or are cached
+ * already are skipped. Returns the number of sectors consumed.
+ */
+static unsigned int pblk_ra_submit(struct pblk *pblk, sector_t blba,
+				   unsigned int nr_secs)
+{
+	struct nvm_tgt_dev *dev = pblk->dev;
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_line_refs refs = PBLK_LINE_REFS_INIT;
+	struct ppa_addr ppas[PBLK_MAX_REQ_ADDRS];
+	struct pblk_g_ctx *r_ctx;
+	struct nvm_rq *rqd;
+	struct bio *bio;
+	int start, run, i;
+
+	pblk_lookup_l2p_seq(pblk, ppas, blba, nr_secs);
+
+	for (start = 0; start < nr_secs; start++) {
+		if (pblk_ppa_empty(ppas[start]) ||
+				pblk_addr_in_cache(ppas[start]))
+			continue;
+		if (!pblk_rcache_cached(pblk, blba + start, ppas[start]))
+			break;
+	}
+
+	for (run = start; run < nr_secs; run++) {
+		if (pblk_ppa_empty(ppas[run]) || pblk_addr_in_cache(ppas[run]))
+			break;
+		if (ppas[run].g.ch != ppas[start].g.ch ||
+				ppas[run].g.lun != ppas[start].g.lun ||
+				ppas[run].g.blk != ppas[start].g.blk)
+			break;
+		if (run > start &&
+			pblk_rcache_cached(pblk, blba + run, ppas[run]))
+			break;
+	}
+	run -= start;
+
+	if (!run)
+		goto out;
+
+	bio = bio_alloc(GFP_NOWAIT | __GFP_NOWARN, run);
+	if (!bio)
+		goto out_no_run;
+
+	for (i = 0; i < run; i++) {
+		struct page *page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+
+		if (!page)
+			break;
+
+		if (bio_add_pc_page(dev->q, bio, page, PBLK_EXPOSED_PAGE_SIZE,
+					0) != PBLK_EXPOSED_PAGE_SIZE) {
+			__free_page(page);
+			break;
+		}
+	}
+
+	/* Read what could be allocated, the rest is left to the reader */
+	run = bio->bi_vcnt;
+	if (!run) {
+		bio_put(bio);
+		goto out_no_run;
+	}
+
+	bio->bi_iter.bi_sector = 0; /* internal bio */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+	bio_set_op_attrs(bio, REQ_OP_READ, 0);
+#endif
+
+	rqd = pblk_alloc_rqd(pblk, PBLK_READ);
+	rqd->opcode = NVM_OP_PREAD;
+	rqd->nr_ppas = run;
+	rqd->bio = bio;
+	rqd->private = pblk;
+	rqd->end_io = pblk_end_io_ra;
+
+	r_ctx = nvm_rq_to_pdu(rqd);
+	r_ctx->start_time = jiffies;
+	r_ctx->lba = blba + start;
+	r_ctx->private = NULL;
+
+	rqd->meta_list = pblk_dev_dma_alloc(dev->parent, GFP_NOWAIT,
+							&rqd->dma_meta_list);
+	if (!rqd->meta_list) {
+		for (i = 0; i < run; i++)
+			__free_page(bio->bi_io_vec[i].bv_page);
+		bio_put(bio);
+		pblk_free_rqd(pblk, rqd, PBLK_READ);
+		goto out_no_run;
+	}
+
+	if (run > 1) {
+		rqd->ppa_list = rqd->meta_list + pblk_dma_meta_size;
+		rqd->dma_ppa_list = rqd->dma_meta_list + pblk_dma_meta_size;
+		memcpy(rqd->ppa_list, &ppas[start],
+					run * sizeof(struct ppa_addr));
+	} else {
+		rqd->ppa_addr = ppas[start];
+	}
+
+	if (pblk_io_aligned(pblk, run))
+		rqd->flags = pblk_set_read_mode(pblk, PBLK_READ_SEQUENTIAL);
+	else
+		rqd->flags = pblk_set_read_mode(pblk, PBLK_READ_RANDOM);
+
+	atomic_inc(&rc->ra_inflight);
+	atomic64_add(run, &rc->ra_issued);
+
+	if (pblk_submit_io(pblk, rqd)) {
+		pr_err("pblk: readahead IO submission failed\n");
+		rqd->error = -EIO;
+		__pblk_end_io_ra(pblk, rqd);
+	}
+
+	goto out;
+
+out_no_run:
+	run = 0;
+	start = nr_secs;
+out:
+	/* Drop the references of the sectors that are not read */
+	for (i = 0; i < nr_secs; i++) {
+		if (i >= start && i < start + run)
+			continue;
+		if (pblk_ppa_empty(ppas[i]) || pblk_addr_in_cache(ppas[i]))
+			continue;
+		pblk_line_refs_put(&refs, &pblk->lines[pblk_ppa_to_line(ppas[i])],
+							pblk_line_put_wq);
+	}
+	pblk_line_refs_put_flush(&refs, pblk_line_put_wq);
+
+	return run ? start + run : nr_secs;
+}
+
+/*
+ * Sequential stream detection. A read starting where a tracked stream ended
+ * continues it; any other read replaces the least recently used stream.
+ * Once a stream has seen PBLK_RA_TRIGGER reads, it is kept a window ahead of
+ * the reader, refilled when half of the window has been consumed. Returns the
+ * number of sectors to prefetch from *ra_lba.
+ */
+static unsigned int pblk_ra_detect(struct pblk *pblk, sector_t blba,
+				   unsigned int nr_secs, sector_t *ra_lba)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	struct pblk_ra_stream *stream, *lru = &rc->streams[0];
+	unsigned int window = READ_ONCE(rc->ra_secs);
+	sector_t end = blba + nr_secs;
+	sector_t ra_end;
+	unsigned int nr = 0;
+	int i;
+
+	spin_lock(&rc->ra_lock);
+	for (i = 0; i < PBLK_RA_STREAMS; i++) {
+		stream = &rc->streams[i];
+		if (stream->next_lba == blba)
+			goto found;
+		if (time_before(stream->stamp, lru->stamp))
+			lru = stream;
+	}
+
+	lru->next_lba = end;
+	lru->ra_lba = end;
+	lru->nr_reads = 1;
+	lru->stamp = jiffies;
+	goto out;
+
+found:
+	stream->next_lba = end;
+	stream->stamp = jiffies;
+	if (++stream->nr_reads < PBLK_RA_TRIGGER)
+		goto out;
+
+	if (stream->ra_lba < end)
+		stream->ra_lba = end;
+	if (stream->ra_lba - end > window / 2)
+		goto out;
+
+	ra_end = min_t(sector_t, end + window, pblk->rl.nr_secs);
+	if (stream->ra_lba >= ra_end)
+		goto out;
+
+	*ra_lba = stream->ra_lba;
+	nr = ra_end - stream->ra_lba;
+	stream->ra_lba = ra_end;
+
+out:
+	spin_unlock(&rc->ra_lock);
+	return nr;
+}
+
+/*
+ * Called once a user read has been submitted. Prefetches are bounded by
+ * PBLK_RA_MAX_RQS; whatever is not prefetched is read on demand.
+ */
+void pblk_read_ahead(struct pblk *pblk, sector_t blba, unsigned int nr_secs)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	sector_t ra_lba;
+	unsigned int nr, done;
+
+	if (!READ_ONCE(rc->ra_secs) || !READ_ONCE(rc->max_pages))
+		return;
+
+	nr = pblk_ra_detect(pblk, blba, nr_secs, &ra_lba);
+
+	while (nr && atomic_read(&rc->ra_inflight) < PBLK_RA_MAX_RQS) {
+		done = pblk_ra_submit(pblk, ra_lba,
+				min_t(unsigned int, nr, pblk->max_read_pgs));
+		ra_lba += done;
+		nr -= done;
+	}
+}
+
 static int read_rq_gc(struct pblk *pblk, struct nvm_rq *rqd,
 		      struct pblk_line *line, sector_t lba,
 		      u64 paddr_gc)
@@ -561,9 +807,7 @@ static int read_rq_gc(struct pblk *pblk, struct nvm_rq *rqd,
 		goto out;
 	}
 
-	spin_lock(&pblk->trans_lock);
 	ppa_l2p = pblk_trans_map_get(pblk, lba);
-	spin_unlock(&pblk->trans_lock);
 
 	ppa_gc = addr_to_gen_ppa(pblk, paddr_gc, line->id);
 	//bookmark: 有新数据写入，这个相同lba并要gc的ppa则不读取了
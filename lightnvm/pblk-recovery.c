@@ -146,7 +146,7 @@ static int pblk_recov_read_oob(struct pblk *pblk, struct pblk_line *line,
 next_read_rq:
 	memset(rqd, 0, pblk_g_rq_size);
 
-	rq_ppas = pblk_calc_secs(pblk, left_ppas, 0);
+	rq_ppas = pblk_calc_secs(pblk, line, left_ppas, 0);
 	if (!rq_ppas)
 		rq_ppas = pblk->min_write_pgs;
 	rq_len = rq_ppas * geo->csecs;
@@ -438,7 +438,7 @@ static int pblk_recov_scan_all_oob(struct pblk *pblk, struct pblk_line *line,
 next_rq:
 	memset(rqd, 0, pblk_g_rq_size);
 
-	rq_ppas = pblk_calc_secs(pblk, left_ppas, 0);
+	rq_ppas = pblk_calc_secs(pblk, line, left_ppas, 0);
 	if (!rq_ppas)
 		rq_ppas = pblk->min_write_pgs;
 	rq_len = rq_ppas * geo->csecs;
@@ -574,7 +574,7 @@ static int pblk_recov_scan_oob(struct pblk *pblk, struct pblk_line *line,
 next_rq:
 	memset(rqd, 0, pblk_g_rq_size);
 
-	rq_ppas = pblk_calc_secs(pblk, left_ppas, 0);
+	rq_ppas = pblk_calc_secs(pblk, line, left_ppas, 0);
 	//printk("ocssd[%s]: left_ppas=%d, rq_ppas=%d\n", __func__, left_ppas, rq_ppas);
 	if (!rq_ppas)
 		rq_ppas = min_write_pgs;
@@ -769,7 +769,7 @@ int pblk_scan_l2p_from_oob(struct pblk *pblk, struct pblk_line *line, uint64_t *
 next_rq:
 	memset(rqd, 0, pblk_g_rq_size);
 
-	rq_ppas = pblk_calc_secs(pblk, left_ppas, 0);
+	rq_ppas = pblk_calc_secs(pblk, line, left_ppas, 0);
 	if (!rq_ppas)
 		rq_ppas = min_write_pgs;
 	rq_len = rq_ppas * geo->csecs;
@@ -977,6 +977,46 @@ static int pblk_line_was_written(struct pblk_line *line,
 	return 1;
 }
 
+/*
+ * Each stream leaves an open line behind. Only the newest one is resumed as
+ * the data line; pad and close the others while the shared emeta buffer still
+ * holds their lba list
+ */
+static int pblk_recov_close_open_line(struct pblk *pblk,
+				      struct pblk_line *line, int meta_line)
+{
+	struct pblk_line_meta *lm = &pblk->lm;
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_emeta *emeta = line->emeta;
+	int ret;
+
+	line->meta_line = meta_line;
+	if (pblk_line_is_slc(pblk, line->id))
+		emeta->nr_entries = lm->emeta_sec[0] / NAND_TLC_STEP;
+	else
+		emeta->nr_entries = lm->emeta_sec[0];
+	emeta->mem = 0;
+	atomic_set(&emeta->sync, 0);
+
+	ret = pblk_recov_pad_oob(pblk, line, line->left_msecs);
+	if (ret) {
+		pr_err("pblk: could not pad open line %d (%d)\n",
+							line->id, ret);
+		return ret;
+	}
+
+	list_del(&line->list);
+	pblk_line_close_meta(pblk, line);
+	pblk_line_close_meta_sync(pblk);
+
+	/* Closing the line released the meta line, which is still in use */
+	spin_lock(&l_mg->free_lock);
+	set_bit(meta_line, &l_mg->meta_bitmap);
+	spin_unlock(&l_mg->free_lock);
+
+	return 0;
+}
+
 struct pblk_line *pblk_recov_l2p(struct pblk *pblk)
 {
 	struct pblk_line_meta *lm = &pblk->lm;
@@ -1125,10 +1165,10 @@ next:
 			line->map_bitmap = NULL;
 			line->smeta = NULL;
 			line->emeta = NULL;
+		} else if (!list_is_last(&line->list, &recov_list)) {
+			if (pblk_recov_close_open_line(pblk, line, meta_line))
+				return ERR_PTR(-EIO);
 		} else {
-			if (open_lines > 1)
-				pr_err("pblk: failed to recover L2P\n");
-
 			open_lines++;
 			line->meta_line = meta_line;
 			data_line = line;
@@ -1167,27 +1207,34 @@ out:
 }
 
 /*
- * Pad current line
+ * Pad current lines, the data line and the open lines of the other streams
  */
 int pblk_recov_pad(struct pblk *pblk)
 {
 	struct pblk_line *line;
 	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	unsigned int stream;
 	int left_msecs;
 	int ret = 0;
 
-	spin_lock(&l_mg->free_lock);
-	line = l_mg->data_line;
-	left_msecs = line->left_msecs;
-	spin_unlock(&l_mg->free_lock);
+	for (stream = 0; stream < PBLK_NR_STREAMS; stream++) {
+		spin_lock(&l_mg->free_lock);
+		line = pblk_stream_line(pblk, stream);
+		left_msecs = (line) ? line->left_msecs : 0;
+		spin_unlock(&l_mg->free_lock);
 
-	printk("ocssd[%s]: pad line=%d\n", __func__, line->id);
-	ret = pblk_recov_pad_oob(pblk, line, left_msecs);
-	if (ret) {
-		pr_err("pblk: Tear down padding failed (%d)\n", ret);
-		return ret;
+		if (!line)
+			continue;
+
+		printk("ocssd[%s]: pad line=%d\n", __func__, line->id);
+		ret = pblk_recov_pad_oob(pblk, line, left_msecs);
+		if (ret) {
+			pr_err("pblk: Tear down padding failed (%d)\n", ret);
+			return ret;
+		}
+
+		pblk_line_close_meta(pblk, line);
 	}
 
-	pblk_line_close_meta(pblk, line);
 	return ret;
 }
@@ -20,7 +20,16 @@
 
 static void pblk_rl_kick_u_timer(struct pblk_rl *rl)
 {
-	mod_timer(&rl->u_timer, jiffies + msecs_to_jiffies(5000));
+	unsigned long expires = jiffies + msecs_to_jiffies(5000);
+
+	/* Do not take the timer base lock on every user write; the user
+	 * activity window does not need better than a second of precision
+	 */
+	if (timer_pending(&rl->u_timer) &&
+			time_before(expires, READ_ONCE(rl->u_timer.expires) + HZ))
+		return;
+
+	mod_timer(&rl->u_timer, expires);
 }
 
 int pblk_rl_is_limit(struct pblk_rl *rl)
@@ -32,16 +41,24 @@ int pblk_rl_is_limit(struct pblk_rl *rl)
 	return (rb_space == 0);
 }
 
-int pblk_rl_user_may_insert(struct pblk_rl *rl, int nr_entries)
+/*
+ * Claim @nr_entries of user budget. The counter is increased up front so that
+ * concurrent producers cannot overcommit the budget without a lock; the caller
+ * returns the entries with pblk_rl_out() if the write buffer is full.
+ */
+int pblk_rl_user_reserve(struct pblk_rl *rl, int nr_entries)
 {
-	int rb_user_cnt = atomic_read(&rl->rb_user_cnt);
 	int rb_space = atomic_read(&rl->rb_space);
+	int rb_user_cnt;
 
 	if (unlikely(rb_space >= 0) && (rb_space - nr_entries < 0))
 		return NVM_IO_ERR;
 
-	if (rb_user_cnt >= rl->rb_user_max)
+	rb_user_cnt = atomic_add_return(nr_entries, &rl->rb_user_cnt);
+	if (rb_user_cnt - nr_entries >= READ_ONCE(rl->rb_user_max)) {
+		atomic_sub(nr_entries, &rl->rb_user_cnt);
 		return NVM_IO_REQUEUE;
+	}
 
 	return NVM_IO_OK;
 }
@@ -54,22 +71,36 @@ void pblk_rl_inserted(struct pblk_rl *rl, int nr_entries)
 		atomic_sub(nr_entries, &rl->rb_space);
 }
 
-int pblk_rl_gc_may_insert(struct pblk_rl *rl, int nr_entries)
+/*
+ * Claim @nr_entries of GC budget, the same way as pblk_rl_user_reserve(). The
+ * GC writer and the write thread (padding with GC data) both claim it. The
+ * caller returns the entries with pblk_rl_out() if the write buffer is full.
+ */
+int pblk_rl_gc_reserve(struct pblk_rl *rl, int nr_entries)
 {
-	int rb_gc_cnt = atomic_read(&rl->rb_gc_cnt);
-	int rb_user_active;
+	int rb_gc_cnt;
+
+	rb_gc_cnt = atomic_add_return(nr_entries, &rl->rb_gc_cnt);
 
 	/* If there is no user I/O let GC take over space on the write buffer */
-	rb_user_active = READ_ONCE(rl->rb_user_active);
-	return (!(rb_gc_cnt >= rl->rb_gc_max && rb_user_active));
+	if (rb_gc_cnt - nr_entries >= rl->rb_gc_max &&
+					READ_ONCE(rl->rb_user_active)) {
+		atomic_sub(nr_entries, &rl->rb_gc_cnt);
+		return 0;
+	}
+
+	return 1;
 }
 
+/*
+ * Budget is already accounted for by pblk_rl_user_reserve(); only mark user
+ * I/O as active here.
+ */
 void pblk_rl_user_in(struct pblk_rl *rl, int nr_entries)
 {
-	atomic_add(nr_entries, &rl->rb_user_cnt);
-
 	/* Release user I/O state. Protect from GC */
-	smp_store_release(&rl->rb_user_active, 1);
+	if (!READ_ONCE(rl->rb_user_active))
+		smp_store_release(&rl->rb_user_active, 1);
 	pblk_rl_kick_u_timer(rl);
 }
 
@@ -85,11 +116,6 @@ void pblk_rl_werr_line_out(struct pblk_rl *rl)
 	printk("ocssd[%s]: write error lines=%d\n", __func__, atomic_read(&rl->werr_lines));
 }
 
-void pblk_rl_gc_in(struct pblk_rl *rl, int nr_entries)
-{
-	atomic_add(nr_entries, &rl->rb_gc_cnt);
-}
-
 void pblk_rl_out(struct pblk_rl *rl, int nr_user, int nr_gc)
 {
 	atomic_sub(nr_user, &rl->rb_user_cnt);
@@ -149,6 +175,8 @@ void pblk_rl_update_slc_rates(struct pblk_rl *rl)
 		pblk_gc_slc_stop(pblk);
 		printk("ocssd[%s]: rb_state=%d, nr_free_slc_lines=%d, close_slc_gc\n", __func__, rl->rb_state, l_mg->nr_free_slc_lines);
 	}
+
+	pblk_rb_wake_producers(&pblk->rwb);
 }
 #endif
 
@@ -195,6 +223,9 @@ static void __pblk_rl_update_rates(struct pblk_rl *rl, unsigned long free_blocks
 		rl->rb_state = PBLK_RL_LOW;
 	}
 
+	/* Budgets might have grown */
+	pblk_rb_wake_producers(&pblk->rwb);
+
 	if (rl->rb_state != PBLK_RL_OFF) {
 		//printk("ocssd[%s]: free_blocks=%ld, rb_state=%d start_gc\n", __func__, free_blocks, rl->rb_state);
 		pblk_gc_should_start(pblk);
@@ -253,17 +284,21 @@ int pblk_rl_max_io(struct pblk_rl *rl)
 static void pblk_rl_u_timer(unsigned long _arg)
 {
 	struct pblk_rl *rl = (struct pblk_rl *)_arg;
+	struct pblk *pblk = container_of(rl, struct pblk, rl);
 
 	/* Release user I/O state. Protect from GC */
 	smp_store_release(&rl->rb_user_active, 0);
+	pblk_rb_wake_producers(&pblk->rwb);
 }
 #else
 static void pblk_rl_u_timer(struct timer_list *t)
 {
 	struct pblk_rl *rl = from_timer(rl, t, u_timer);
+	struct pblk *pblk = container_of(rl, struct pblk, rl);
 
 	/* Release user I/O state. Protect from GC */
 	smp_store_release(&rl->rb_user_active, 0);
+	pblk_rb_wake_producers(&pblk->rwb);
 }
 #endif
 
@@ -272,6 +307,28 @@ void pblk_rl_free(struct pblk_rl *rl)
 	del_timer(&rl->u_timer);
 }
 
+static void pblk_rl_set_budget(struct pblk_rl *rl, int budget)
+{
+	unsigned int rb_windows;
+
+	/* This will always be a power-of-2 */
+	rb_windows = budget / PBLK_MAX_REQ_ADDRS;
+	rl->rb_windows_pw = get_count_order(rb_windows);
+
+	rl->rb_budget = budget;
+	rl->rb_max_io = budget >> 1;
+}
+
+/* The write buffer has been resized; recalculate user and GC budgets */
+void pblk_rl_resize(struct pblk_rl *rl, int budget)
+{
+	pblk_rl_set_budget(rl, budget);
+
+	rl->rb_user_max = min(rl->rb_user_max, budget);
+	rl->rb_gc_max = min(rl->rb_gc_max, budget);
+	pblk_rl_update_rates(rl);
+}
+
 void pblk_rl_init(struct pblk_rl *rl, int budget)
 {
 	struct pblk *pblk = container_of(rl, struct pblk, rl);
@@ -282,8 +339,6 @@ void pblk_rl_init(struct pblk_rl *rl, int budget)
 	int min_blocks = lm->blk_per_line * PBLK_GC_RSV_LINE;
 	int sec_meta, blk_meta;
 
-	unsigned int rb_windows;
-
 	/* Consider sectors used for metadata */
 	sec_meta = (lm->smeta_sec + lm->emeta_sec[0]) * l_mg->nr_free_lines;
 	blk_meta = DIV_ROUND_UP(sec_meta, geo->clba);
@@ -293,14 +348,10 @@ void pblk_rl_init(struct pblk_rl *rl, int budget)
 
 	rl->rsv_blocks = min_blocks;
 
-	/* This will always be a power-of-2 */
-	rb_windows = budget / PBLK_MAX_REQ_ADDRS;
-	rl->rb_windows_pw = get_count_order(rb_windows);
+	pblk_rl_set_budget(rl, budget);
 
 	/* To start with, all buffer is available to user I/O writers */
-	rl->rb_budget = budget;
 	rl->rb_user_max = budget;
-	rl->rb_max_io = budget >> 1;
 	rl->rb_gc_max = 0;
 	rl->rb_state = PBLK_RL_HIGH;
 
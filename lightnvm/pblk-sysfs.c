@@ -109,6 +109,11 @@ static ssize_t pblk_sysfs_write_buffer(struct pblk *pblk, char *page)
 	return pblk_rb_sysfs(&pblk->rwb, page);
 }
 
+static ssize_t pblk_sysfs_get_write_buffer_size(struct pblk *pblk, char *page)
+{
+	return snprintf(page, PAGE_SIZE, "%u\n", READ_ONCE(pblk->rwb.nr_entries));
+}
+
 static ssize_t pblk_sysfs_ppaf(struct pblk *pblk, char *page)
 {
 	struct nvm_tgt_dev *dev = pblk->dev;
@@ -338,6 +343,11 @@ static ssize_t pblk_sysfs_get_sec_per_write(struct pblk *pblk, char *page)
 	return snprintf(page, PAGE_SIZE, "%d\n", pblk->sec_per_write);
 }
 
+static ssize_t pblk_sysfs_get_zc_min_secs(struct pblk *pblk, char *page)
+{
+	return snprintf(page, PAGE_SIZE, "%u\n", READ_ONCE(pblk->zc_min_secs));
+}
+
 static ssize_t pblk_get_write_amp(u64 user, u64 gc, u64 pad,
 				  char *page)
 {
@@ -380,6 +390,189 @@ static ssize_t pblk_sysfs_get_write_amp_trip(struct pblk *pblk, char *page)
 		atomic64_read(&pblk->pad_wa) - pblk->pad_rst_wa, page);
 }
 
+/* Sectors left on the write buffer because they were overwritten there */
+static ssize_t pblk_sysfs_get_write_coalesced(struct pblk *pblk, char *page)
+{
+	return snprintf(page, PAGE_SIZE, "%lld\n",
+			(u64)atomic64_read(&pblk->coalesced_wa));
+}
+
+static ssize_t pblk_sysfs_get_flush_window(struct pblk *pblk, char *page)
+{
+	return snprintf(page, PAGE_SIZE,
+			"max_us:%u window_us:%llu windows:%lld pad_saved:%lld pad_gc:%lld\n",
+			READ_ONCE(pblk->flush_window_max),
+			div_u64(pblk_write_flush_window(pblk), NSEC_PER_USEC),
+			(u64)atomic64_read(&pblk->flush_windows),
+			(u64)atomic64_read(&pblk->flush_pad_saved),
+			(u64)atomic64_read(&pblk->pad_gc));
+}
+
+static ssize_t pblk_sysfs_get_write_batch(struct pblk *pblk, char *page)
+{
+	u64 reqs = atomic64_read(&pblk->batch_reqs);
+	u64 secs = atomic64_read(&pblk->batch_secs);
+
+	return snprintf(page, PAGE_SIZE,
+		"max_us:%u ns_per_sec:%llu waits:%lld timeouts:%lld now:%lld full:%lld reqs:%lld avg_secs:%llu stripe_secs:%u\n",
+		READ_ONCE(pblk->batch_max_us),
+		READ_ONCE(pblk->batch_avg_ns),
+		(u64)atomic64_read(&pblk->batch_waits),
+		(u64)atomic64_read(&pblk->batch_timeouts),
+		(u64)atomic64_read(&pblk->batch_now),
+		(u64)atomic64_read(&pblk->batch_full),
+		reqs, reqs ? div64_u64(secs, reqs) : 0,
+		pblk_write_batch_secs(pblk, 0));
+}
+
+/* Write requests served from the pre-built pool vs. allocated on the spot */
+static ssize_t pblk_sysfs_get_write_prealloc(struct pblk *pblk, char *page)
+{
+	return snprintf(page, PAGE_SIZE,
+			"hits:%lld misses:%lld free:%u total:%u\n",
+			(u64)atomic64_read(&pblk->w_pre_hits),
+			(u64)atomic64_read(&pblk->w_pre_misses),
+			READ_ONCE(pblk->nr_w_pre_free), pblk->nr_w_pre);
+}
+
+/* Per stream sectors written by user, GC and padding, and lines opened. The
+ * last stream is the SLC one (see slc_place)
+ */
+static ssize_t pblk_sysfs_get_write_streams(struct pblk *pblk, char *page)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_line *line;
+	int sz, i;
+
+	sz = snprintf(page, PAGE_SIZE, "streams:%u/%d fallbacks:%lld\n",
+			READ_ONCE(pblk->nr_streams), PBLK_MAX_STREAMS,
+			(u64)atomic64_read(&pblk->stream_fallbacks));
+
+	spin_lock(&l_mg->free_lock);
+	for (i = 0; i < PBLK_NR_STREAMS; i++) {
+		line = pblk_stream_line(pblk, i);
+		sz += snprintf(page + sz, PAGE_SIZE - sz,
+			"%d: line:%d user:%lld gc:%lld pad:%lld lines:%lld\n",
+			i, (line) ? line->id : -1,
+			(u64)atomic64_read(&pblk->stream_user[i]),
+			(u64)atomic64_read(&pblk->stream_gc[i]),
+			(u64)atomic64_read(&pblk->stream_pad[i]),
+			(u64)atomic64_read(&pblk->stream_lines[i]));
+	}
+	spin_unlock(&l_mg->free_lock);
+
+	return sz;
+}
+
+/*
+ * Sectors per write class, and per stream: overwrites whose previous copy was
+ * on a line of the same stream, and sectors GC had to move per reclaimed line
+ */
+static ssize_t pblk_sysfs_get_write_class(struct pblk *pblk, char *page)
+{
+	struct pblk_class *cls = &pblk->cls;
+	u64 rw, hit, lines, moved;
+	int sz, i;
+
+	sz = snprintf(page, PAGE_SIZE,
+		"hot_thrs:%u counters:%u hot:%lld seq:%lld cold:%lld\n",
+		READ_ONCE(cls->hot_thrs), 1U << cls->cnt_bits,
+		(u64)atomic64_read(&cls->secs[PBLK_CLASS_HOT]),
+		(u64)atomic64_read(&cls->secs[PBLK_CLASS_SEQ]),
+		(u64)atomic64_read(&cls->secs[PBLK_CLASS_COLD]));
+
+	for (i = 0; i < PBLK_NR_STREAMS; i++) {
+		rw = atomic64_read(&pblk->stream_rw[i]);
+		hit = atomic64_read(&pblk->stream_rw_hit[i]);
+		lines = atomic64_read(&pblk->stream_gc_lines[i]);
+		moved = atomic64_read(&pblk->stream_gc_moved[i]);
+
+		sz += snprintf(page + sz, PAGE_SIZE - sz,
+			"%d: rewrites:%llu hit:%llu%% gc_lines:%llu gc_moved:%llu per_line:%llu\n",
+			i, rw, rw ? div64_u64(hit * 100, rw) : 0,
+			lines, moved, lines ? div64_u64(moved, lines) : 0);
+	}
+
+	return sz;
+}
+
+static ssize_t pblk_sysfs_get_slc_place(struct pblk *pblk, char *page)
+{
+	return snprintf(page, PAGE_SIZE,
+			"max_secs:%u user:%lld pad:%lld lines:%lld\n",
+			READ_ONCE(pblk->slc_place_secs),
+			(u64)atomic64_read(&pblk->stream_user[PBLK_STREAM_SLC]),
+			(u64)atomic64_read(&pblk->stream_pad[PBLK_STREAM_SLC]),
+			(u64)atomic64_read(&pblk->stream_lines[PBLK_STREAM_SLC]));
+}
+
+static ssize_t pblk_sysfs_get_read_ahead(struct pblk *pblk, char *page)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	u64 issued = atomic64_read(&rc->ra_issued);
+	u64 hits = atomic64_read(&rc->ra_hits);
+	u64 waste = atomic64_read(&rc->ra_waste);
+
+	return snprintf(page, PAGE_SIZE,
+		"window:%u issued:%llu hits:%llu(%llu%%) waste:%llu(%llu%%) cached:%d/%u\n",
+		READ_ONCE(rc->ra_secs), issued,
+		hits, issued ? div64_u64(hits * 100, issued) : 0,
+		waste, issued ? div64_u64(waste * 100, issued) : 0,
+		atomic_read(&rc->nr_pages), rc->max_pages);
+}
+
+static ssize_t pblk_sysfs_get_read_cache(struct pblk *pblk, char *page)
+{
+	struct pblk_rcache *rc = &pblk->rc;
+	u64 lookups, hits;
+	int sz, i;
+
+	spin_lock_irq(&rc->lock);
+	sz = snprintf(page, PAGE_SIZE,
+		"max_pages:%u pages:%d a1in:%u am:%u a1out:%u policy:%s\n",
+		rc->max_pages, atomic_read(&rc->nr_pages),
+		rc->q_len[PBLK_RC_A1IN], rc->q_len[PBLK_RC_AM],
+		rc->q_len[PBLK_RC_A1OUT], pblk_rcache_policy_name(rc->policy));
+	spin_unlock_irq(&rc->lock);
+
+	for (i = 0; i < PBLK_RC_NR_POLICIES; i++) {
+		lookups = atomic64_read(&rc->lookups[i]);
+		hits = atomic64_read(&rc->hits[i]);
+
+		sz += snprintf(page + sz, PAGE_SIZE - sz,
+			"%s: lookups:%llu hits:%llu(%llu%%)\n",
+			pblk_rcache_policy_name(i), lookups, hits,
+			lookups ? div64_u64(hits * 100, lookups) : 0);
+	}
+
+	sz += snprintf(page + sz, PAGE_SIZE - sz,
+		"hits: a1in:%lld am:%lld a1out:%lld\n",
+		(u64)atomic64_read(&rc->q_hits[PBLK_RC_A1IN]),
+		(u64)atomic64_read(&rc->q_hits[PBLK_RC_AM]),
+		(u64)atomic64_read(&rc->q_hits[PBLK_RC_A1OUT]));
+
+	sz += snprintf(page + sz, PAGE_SIZE - sz,
+		"fill:%#x read:%lld ra:%lld wb:%lld shrunk:%lld\n",
+		READ_ONCE(rc->fill),
+		(u64)atomic64_read(&rc->fills[PBLK_RC_SRC_READ]),
+		(u64)atomic64_read(&rc->fills[PBLK_RC_SRC_RA]),
+		(u64)atomic64_read(&rc->fills[PBLK_RC_SRC_WB]),
+		(u64)atomic64_read(&rc->shrunk));
+
+	return sz;
+}
+
+static ssize_t pblk_sysfs_get_read_cache_policy(struct pblk *pblk, char *page)
+{
+	return snprintf(page, PAGE_SIZE, "%s\n",
+			pblk_rcache_policy_name(READ_ONCE(pblk->rc.policy)));
+}
+
+static ssize_t pblk_sysfs_get_read_cache_fill(struct pblk *pblk, char *page)
+{
+	return snprintf(page, PAGE_SIZE, "%#x\n", READ_ONCE(pblk->rc.fill));
+}
+
 static long long bucket_percentage(unsigned long long bucket,
 				   unsigned long long total)
 {
@@ -444,6 +637,8 @@ static ssize_t pblk_sysfs_stats_debug(struct pblk *pblk, char *page)
 	sz += snprintf(page + sz, PAGE_SIZE - sz, "cache_reads: %lu\n", atomic_long_read(&pblk->cache_reads));
 	sz += snprintf(page + sz, PAGE_SIZE - sz, "sync_writes: %lu\n", atomic_long_read(&pblk->sync_writes));
 	sz += snprintf(page + sz, PAGE_SIZE - sz, "sync_reads: %lu\n", atomic_long_read(&pblk->sync_reads));
+	sz += snprintf(page + sz, PAGE_SIZE - sz, "zc_writes: %lu\n", atomic_long_read(&pblk->zc_writes));
+	sz += snprintf(page + sz, PAGE_SIZE - sz, "read_splits: %lu\n", atomic_long_read(&pblk->read_splits));
 	return sz;
 /*
 	return snprintf(page, PAGE_SIZE,
@@ -506,6 +701,243 @@ static ssize_t pblk_sysfs_set_sec_per_write(struct pblk *pblk,
 	return len;
 }
 
+/* 0 disables zero-copy writes */
+static ssize_t pblk_sysfs_set_zc_min_secs(struct pblk *pblk,
+					  const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int zc_min_secs;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &zc_min_secs))
+		return -EINVAL;
+
+	if (zc_min_secs && zc_min_secs < pblk->min_write_pgs)
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->zc_min_secs, zc_min_secs);
+
+	return len;
+}
+
+/* Entries are rounded up to a power of two */
+static ssize_t pblk_sysfs_set_write_buffer_size(struct pblk *pblk,
+						const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int nr_entries;
+	int ret;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &nr_entries))
+		return -EINVAL;
+
+	if (nr_entries < pblk->pgs_in_buffer || nr_entries > (1U << 30))
+		return -EINVAL;
+
+	if (pblk->state != PBLK_STATE_RUNNING)
+		return -EBUSY;
+
+	ret = pblk_rb_resize(&pblk->rwb, pblk_rb_calculate_size(nr_entries));
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+/* Max. group-commit window in usecs; 0 pads flushes right away */
+static ssize_t pblk_sysfs_set_flush_window(struct pblk *pblk,
+					   const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int window;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &window))
+		return -EINVAL;
+
+	if (window > USEC_PER_SEC)
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->flush_window_max, window);
+
+	return len;
+}
+
+static ssize_t pblk_sysfs_set_write_batch(struct pblk *pblk,
+					  const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int wait;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &wait))
+		return -EINVAL;
+
+	if (wait > USEC_PER_SEC)
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->batch_max_us, wait);
+
+	return len;
+}
+
+static ssize_t pblk_sysfs_set_write_streams(struct pblk *pblk,
+					    const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int nr_streams;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &nr_streams))
+		return -EINVAL;
+
+	if (nr_streams < 1 || nr_streams > PBLK_MAX_STREAMS)
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->nr_streams, nr_streams);
+
+	return len;
+}
+
+static ssize_t pblk_sysfs_set_write_class(struct pblk *pblk,
+					  const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int thrs;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &thrs))
+		return -EINVAL;
+
+	if (thrs > U8_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->cls.hot_thrs, thrs);
+
+	return len;
+}
+
+/* Synchronous writes of fewer sectors go to an SLC line, 0 disables */
+static ssize_t pblk_sysfs_set_slc_place(struct pblk *pblk,
+					const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int secs;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &secs))
+		return -EINVAL;
+
+	if (secs > pblk->max_write_pgs)
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->slc_place_secs, secs);
+
+	return len;
+}
+
+static ssize_t pblk_sysfs_set_read_ahead(struct pblk *pblk,
+					 const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int secs;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &secs))
+		return -EINVAL;
+
+	if (secs > PBLK_RA_MAX_SECS)
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->rc.ra_secs, secs);
+
+	return len;
+}
+
+/* Read cache size in pages; 0 disables the cache and frees it */
+static ssize_t pblk_sysfs_set_read_cache(struct pblk *pblk,
+					 const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int pages;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &pages))
+		return -EINVAL;
+
+	if (pages > PBLK_RC_MAX_PAGES)
+		return -EINVAL;
+
+	pblk_rcache_resize(pblk, pages);
+
+	return len;
+}
+
+static ssize_t pblk_sysfs_set_read_cache_policy(struct pblk *pblk,
+						const char *page, size_t len)
+{
+	int i;
+
+	for (i = 0; i < PBLK_RC_NR_POLICIES; i++) {
+		if (sysfs_streq(page, pblk_rcache_policy_name(i))) {
+			pblk_rcache_set_policy(pblk, i);
+			return len;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/* Mask of the sources that fill the read cache, besides readahead */
+static ssize_t pblk_sysfs_set_read_cache_fill(struct pblk *pblk,
+					      const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int fill;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &fill))
+		return -EINVAL;
+
+	if (fill & ~(PBLK_RC_FILL_READ | PBLK_RC_FILL_WB))
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->rc.fill, fill);
+
+	return len;
+}
+
 static ssize_t pblk_sysfs_set_write_amp_trip(struct pblk *pblk,
 			const char *page, size_t len)
 {
@@ -619,6 +1051,11 @@ static struct attribute sys_rb_attr = {
 	.mode = 0444,
 };
 
+static struct attribute sys_rb_size_attr = {
+	.name = "write_buffer_size",
+	.mode = 0644,
+};
+
 static struct attribute sys_stats_ppaf_attr = {
 	.name = "ppa_format",
 	.mode = 0444,
@@ -644,6 +1081,11 @@ static struct attribute sys_max_sec_per_write = {
 	.mode = 0644,
 };
 
+static struct attribute sys_zc_min_secs = {
+	.name = "zero_copy_min_secs",
+	.mode = 0644,
+};
+
 static struct attribute sys_write_amp_mileage = {
 	.name = "write_amp_mileage",
 	.mode = 0444,
@@ -654,6 +1096,61 @@ static struct attribute sys_write_amp_trip = {
 	.mode = 0644,
 };
 
+static struct attribute sys_write_coalesced = {
+	.name = "write_coalesced",
+	.mode = 0444,
+};
+
+static struct attribute sys_flush_window = {
+	.name = "flush_window",
+	.mode = 0644,
+};
+
+static struct attribute sys_write_batch = {
+	.name = "write_batch",
+	.mode = 0644,
+};
+
+static struct attribute sys_write_prealloc = {
+	.name = "write_prealloc",
+	.mode = 0444,
+};
+
+static struct attribute sys_write_streams = {
+	.name = "write_streams",
+	.mode = 0644,
+};
+
+static struct attribute sys_write_class = {
+	.name = "write_class",
+	.mode = 0644,
+};
+
+static struct attribute sys_slc_place = {
+	.name = "slc_place",
+	.mode = 0644,
+};
+
+static struct attribute sys_read_ahead = {
+	.name = "read_ahead",
+	.mode = 0644,
+};
+
+static struct attribute sys_read_cache = {
+	.name = "read_cache",
+	.mode = 0644,
+};
+
+static struct attribute sys_read_cache_policy = {
+	.name = "read_cache_policy",
+	.mode = 0644,
+};
+
+static struct attribute sys_read_cache_fill = {
+	.name = "read_cache_fill",
+	.mode = 0644,
+};
+
 static struct attribute sys_padding_dist = {
 	.name = "padding_dist",
 	.mode = 0644,
@@ -678,12 +1175,25 @@ static struct attribute *pblk_attrs[] = {
 	&sys_gc_state,
 	&sys_gc_force,
 	&sys_max_sec_per_write,
+	&sys_zc_min_secs,
 	&sys_rb_attr,
+	&sys_rb_size_attr,
 	&sys_stats_ppaf_attr,
 	&sys_lines_attr,
 	&sys_lines_info_attr,
 	&sys_write_amp_mileage,
 	&sys_write_amp_trip,
+	&sys_write_coalesced,
+	&sys_flush_window,
+	&sys_write_batch,
+	&sys_write_prealloc,
+	&sys_write_streams,
+	&sys_write_class,
+	&sys_slc_place,
+	&sys_read_ahead,
+	&sys_read_cache,
+	&sys_read_cache_policy,
+	&sys_read_cache_fill,
 	&sys_padding_dist,
 #ifdef CONFIG_NVM_DEBUG
 	&sys_stats_debug_attr,
@@ -707,6 +1217,8 @@ static ssize_t pblk_sysfs_show(struct kobject *kobj, struct attribute *attr,
 		return pblk_sysfs_stats(pblk, buf);
 	else if (strcmp(attr->name, "write_buffer") == 0)
 		return pblk_sysfs_write_buffer(pblk, buf);
+	else if (strcmp(attr->name, "write_buffer_size") == 0)
+		return pblk_sysfs_get_write_buffer_size(pblk, buf);
 	else if (strcmp(attr->name, "ppa_format") == 0)
 		return pblk_sysfs_ppaf(pblk, buf);
 	else if (strcmp(attr->name, "lines") == 0)
@@ -715,10 +1227,34 @@ static ssize_t pblk_sysfs_show(struct kobject *kobj, struct attribute *attr,
 		return pblk_sysfs_lines_info(pblk, buf);
 	else if (strcmp(attr->name, "max_sec_per_write") == 0)
 		return pblk_sysfs_get_sec_per_write(pblk, buf);
+	else if (strcmp(attr->name, "zero_copy_min_secs") == 0)
+		return pblk_sysfs_get_zc_min_secs(pblk, buf);
 	else if (strcmp(attr->name, "write_amp_mileage") == 0)
 		return pblk_sysfs_get_write_amp_mileage(pblk, buf);
 	else if (strcmp(attr->name, "write_amp_trip") == 0)
 		return pblk_sysfs_get_write_amp_trip(pblk, buf);
+	else if (strcmp(attr->name, "write_coalesced") == 0)
+		return pblk_sysfs_get_write_coalesced(pblk, buf);
+	else if (strcmp(attr->name, "flush_window") == 0)
+		return pblk_sysfs_get_flush_window(pblk, buf);
+	else if (strcmp(attr->name, "write_batch") == 0)
+		return pblk_sysfs_get_write_batch(pblk, buf);
+	else if (strcmp(attr->name, "write_prealloc") == 0)
+		return pblk_sysfs_get_write_prealloc(pblk, buf);
+	else if (strcmp(attr->name, "write_streams") == 0)
+		return pblk_sysfs_get_write_streams(pblk, buf);
+	else if (strcmp(attr->name, "write_class") == 0)
+		return pblk_sysfs_get_write_class(pblk, buf);
+	else if (strcmp(attr->name, "slc_place") == 0)
+		return pblk_sysfs_get_slc_place(pblk, buf);
+	else if (strcmp(attr->name, "read_ahead") == 0)
+		return pblk_sysfs_get_read_ahead(pblk, buf);
+	else if (strcmp(attr->name, "read_cache") == 0)
+		return pblk_sysfs_get_read_cache(pblk, buf);
+	else if (strcmp(attr->name, "read_cache_policy") == 0)
+		return pblk_sysfs_get_read_cache_policy(pblk, buf);
+	else if (strcmp(attr->name, "read_cache_fill") == 0)
+		return pblk_sysfs_get_read_cache_fill(pblk, buf);
 	else if (strcmp(attr->name, "padding_dist") == 0)
 		return pblk_sysfs_get_padding_dist(pblk, buf);
 #ifdef CONFIG_NVM_DEBUG
@@ -739,8 +1275,30 @@ static ssize_t pblk_sysfs_store(struct kobject *kobj, struct attribute *attr,
 		return pblk_sysfs_gc_force(pblk, buf, len);
 	else if (strcmp(attr->name, "max_sec_per_write") == 0)
 		return pblk_sysfs_set_sec_per_write(pblk, buf, len);
+	else if (strcmp(attr->name, "write_buffer_size") == 0)
+		return pblk_sysfs_set_write_buffer_size(pblk, buf, len);
+	else if (strcmp(attr->name, "zero_copy_min_secs") == 0)
+		return pblk_sysfs_set_zc_min_secs(pblk, buf, len);
 	else if (strcmp(attr->name, "write_amp_trip") == 0)
 		return pblk_sysfs_set_write_amp_trip(pblk, buf, len);
+	else if (strcmp(attr->name, "flush_window") == 0)
+		return pblk_sysfs_set_flush_window(pblk, buf, len);
+	else if (strcmp(attr->name, "write_batch") == 0)
+		return pblk_sysfs_set_write_batch(pblk, buf, len);
+	else if (strcmp(attr->name, "write_streams") == 0)
+		return pblk_sysfs_set_write_streams(pblk, buf, len);
+	else if (strcmp(attr->name, "write_class") == 0)
+		return pblk_sysfs_set_write_class(pblk, buf, len);
+	else if (strcmp(attr->name, "slc_place") == 0)
+		return pblk_sysfs_set_slc_place(pblk, buf, len);
+	else if (strcmp(attr->name, "read_ahead") == 0)
+		return pblk_sysfs_set_read_ahead(pblk, buf, len);
+	else if (strcmp(attr->name, "read_cache") == 0)
+		return pblk_sysfs_set_read_cache(pblk, buf, len);
+	else if (strcmp(attr->name, "read_cache_policy") == 0)
+		return pblk_sysfs_set_read_cache_policy(pblk, buf, len);
+	else if (strcmp(attr->name, "read_cache_fill") == 0)
+		return pblk_sysfs_set_read_cache_fill(pblk, buf, len);
 	else if (strcmp(attr->name, "padding_dist") == 0)
 		return pblk_sysfs_set_padding_dist(pblk, buf, len);
 	else if (strcmp(attr->name, "trans_map") == 0)
@@ -17,6 +17,111 @@
 
 #include "pblk.h"
 
+/*
+ * Take a write request from the pre-built pool. If all of them are in flight,
+ * fall back to allocating one, which is accounted as a miss.
+ */
+static struct nvm_rq *pblk_w_rqd_get(struct pblk *pblk, unsigned int nr_secs)
+{
+	struct pblk_w_prealloc *pre = NULL;
+	struct pblk_c_ctx *c_ctx;
+	struct nvm_rq *rqd;
+	struct bio *bio;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pblk->w_pre_lock, flags);
+	if (!list_empty(&pblk->w_pre_list)) {
+		pre = list_first_entry(&pblk->w_pre_list,
+					struct pblk_w_prealloc, list);
+		list_del(&pre->list);
+		pblk->nr_w_pre_free--;
+	}
+	spin_unlock_irqrestore(&pblk->w_pre_lock, flags);
+
+	if (pre) {
+		rqd = pre->rqd;
+		memset(rqd, 0, pblk_w_rq_size);
+		rqd->meta_list = pre->meta_list;
+		rqd->dma_meta_list = pre->dma_meta_list;
+		rqd->cmd = pre->cmd;
+
+		bio = pre->bio;
+		bio_reset(bio);
+
+		atomic64_inc(&pblk->w_pre_hits);
+	} else {
+		rqd = pblk_alloc_rqd(pblk, PBLK_WRITE);
+		bio = bio_alloc(GFP_KERNEL, nr_secs);
+
+		atomic64_inc(&pblk->w_pre_misses);
+	}
+
+	bio->bi_iter.bi_sector = 0; /* internal bio */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+	bio->bi_rw |= REQ_WRITE;
+#else
+	bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
+#endif
+	rqd->bio = bio;
+
+	c_ctx = nvm_rq_to_pdu(rqd);
+	c_ctx->pre = pre;
+
+	return rqd;
+}
+
+static void pblk_w_rqd_put(struct pblk *pblk, struct nvm_rq *rqd)
+{
+	struct pblk_c_ctx *c_ctx = nvm_rq_to_pdu(rqd);
+	struct pblk_w_prealloc *pre = c_ctx->pre;
+	unsigned long flags;
+	bool wake;
+
+	if (!pre) {
+		if (c_ctx->nr_padded)
+			pblk_bio_free_pages(pblk, rqd->bio,
+					c_ctx->nr_valid - c_ctx->nr_skipped,
+					c_ctx->nr_padded);
+		bio_put(rqd->bio);
+		pblk_free_rqd(pblk, rqd, PBLK_WRITE);
+		return;
+	}
+
+	/* Completions run under the write buffer sync lock, with irqs off */
+	spin_lock_irqsave(&pblk->w_pre_lock, flags);
+	list_add(&pre->list, &pblk->w_pre_list);
+	wake = !pblk->nr_w_pre_free++;
+	spin_unlock_irqrestore(&pblk->w_pre_lock, flags);
+
+	/* The write thread stops mapping when the pool runs dry */
+	if (wake)
+		wake_up(&pblk->w_pre_wait);
+}
+
+/* Pad a write request up to the minimum write size */
+int pblk_write_add_pad(struct pblk *pblk, struct nvm_rq *rqd, int nr_pages)
+{
+	struct pblk_c_ctx *c_ctx = nvm_rq_to_pdu(rqd);
+	struct pblk_w_prealloc *pre = c_ctx->pre;
+	struct request_queue *q = pblk->dev->q;
+	int i, ret;
+
+	if (!pre)
+		return pblk_bio_add_pages(pblk, rqd->bio, GFP_KERNEL, nr_pages);
+
+	/* Padding is never read back; pre-built requests carry their pages */
+	for (i = 0; i < nr_pages; i++) {
+		ret = bio_add_pc_page(q, rqd->bio, pre->pad_pages[i],
+						PBLK_EXPOSED_PAGE_SIZE, 0);
+		if (ret != PBLK_EXPOSED_PAGE_SIZE) {
+			pr_err("pblk: could not add page to bio\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static unsigned long pblk_end_w_bio(struct pblk *pblk, struct nvm_rq *rqd,
 				    struct pblk_c_ctx *c_ctx)
 {
@@ -48,34 +153,21 @@ static unsigned long pblk_end_w_bio(struct pblk *pblk, struct nvm_rq *rqd,
 			bio_endio(original_bio);
 	}
 
-	if (c_ctx->nr_padded)
-		pblk_bio_free_pages(pblk, rqd->bio, c_ctx->nr_valid,
-							c_ctx->nr_padded);
-
 #ifdef CONFIG_NVM_DEBUG
 	atomic_long_add(rqd->nr_ppas, &pblk->sync_writes);
 #endif
 
 	ret = pblk_rb_sync_advance(&pblk->rwb, c_ctx->nr_valid);
 
-	bio_put(rqd->bio);
-	pblk_free_rqd(pblk, rqd, PBLK_WRITE);
+	pblk_w_rqd_put(pblk, rqd);
 
 	return ret;
 }
 
-static unsigned long pblk_end_queued_w_bio(struct pblk *pblk,
-					   struct nvm_rq *rqd,
-					   struct pblk_c_ctx *c_ctx)
-{
-	list_del(&c_ctx->list);
-	return pblk_end_w_bio(pblk, rqd, c_ctx);
-}
-
 static void pblk_complete_write(struct pblk *pblk, struct nvm_rq *rqd,
 				struct pblk_c_ctx *c_ctx)
 {
-	struct pblk_c_ctx *c, *r;
+	struct pblk_c_ctx *c;
 	unsigned long flags;
 	unsigned long pos;
 
@@ -83,23 +175,23 @@ static void pblk_complete_write(struct pblk *pblk, struct nvm_rq *rqd,
 	atomic_long_sub(c_ctx->nr_valid, &pblk->inflight_writes);
 #endif
 
-	pblk_up_rq(pblk, rqd->ppa_list, rqd->nr_ppas, c_ctx->lun_bitmap);
+	/* Requests made only of skipped entries hold no LUN */
+	if (c_ctx->lun_bitmap)
+		pblk_up_rq(pblk, rqd->ppa_list, rqd->nr_ppas,
+							c_ctx->lun_bitmap);
 
 	pos = pblk_rb_sync_init(&pblk->rwb, &flags);
 	if (pos == c_ctx->sentry) {
 		pos = pblk_end_w_bio(pblk, rqd, c_ctx);
 
-retry:
-		list_for_each_entry_safe(c, r, &pblk->compl_list, list) {
-			rqd = nvm_rq_from_c_ctx(c);
-			if (c->sentry == pos) {
-				pos = pblk_end_queued_w_bio(pblk, rqd, c);
-				goto retry;
-			}
-		}
+		/* Requests that completed out of order wait on the entry the
+		 * sync pointer has to reach
+		 */
+		while ((c = pblk_rb_compl_pop(&pblk->rwb, pos)))
+			pos = pblk_end_w_bio(pblk, nvm_rq_from_c_ctx(c), c);
 	} else {
 		WARN_ON(nvm_rq_from_c_ctx(c_ctx) != rqd);
-		list_add_tail(&c_ctx->list, &pblk->compl_list);
+		pblk_rb_compl_queue(&pblk->rwb, c_ctx);
 	}
 	pblk_rb_sync_end(&pblk->rwb, &flags);
 }
@@ -196,25 +288,22 @@ static void pblk_map_remaining(struct pblk *pblk, struct ppa_addr *ppas, uint16_
 static void pblk_prepare_resubmit(struct pblk *pblk, unsigned int sentry,
 				  unsigned int nr_entries)
 {
+	struct pblk_line_refs refs = PBLK_LINE_REFS_INIT;
 	struct pblk_rb *rb = &pblk->rwb;
 	struct pblk_rb_entry *entry;
 	struct pblk_line *line;
 	struct pblk_w_ctx *w_ctx;
-	struct ppa_addr ppa_l2p;
 	int flags;
 	unsigned int pos, i;
 
-	spin_lock(&pblk->trans_lock);
+	/* Overwritten entries are left to pblk_rb_read_to_bio(), which only
+	 * skips them when no pending flush depends on them
+	 */
 	pos = sentry;
 	for (i = 0; i < nr_entries; i++) {
 		entry = &rb->entries[pos];
 		w_ctx = &entry->w_ctx;
 
-		/* Check if the lba has been overwritten */
-		ppa_l2p = pblk_trans_map_get(pblk, w_ctx->lba);
-		if (!pblk_ppa_comp(ppa_l2p, entry->cacheline))
-			w_ctx->lba = ADDR_EMPTY;
-
 		/* Mark up the entry as submittable again */
 		flags = READ_ONCE(w_ctx->flags);
 		flags |= PBLK_WRITTEN_DATA;
@@ -223,14 +312,16 @@ static void pblk_prepare_resubmit(struct pblk *pblk, unsigned int sentry,
 		//printk("ocssd[%s]: pos=%d, w_ctx->flags=0x%x\n", __func__, pos, w_ctx->flags);
 
 		/* Decrese the reference count to the line as we will
-		 * re-map these entries
+		 * re-map these entries. Skipped entries were never mapped
 		 */
-		line = &pblk->lines[pblk_ppa_to_line(w_ctx->ppa)];
-		kref_put(&line->ref, pblk_line_put);
+		if (!(flags & PBLK_SKIPPED_ENTRY)) {
+			line = &pblk->lines[pblk_ppa_to_line(w_ctx->ppa)];
+			pblk_line_refs_put(&refs, line, pblk_line_put);
+		}
 
 		pos = (pos + 1) & (rb->nr_entries - 1);
 	}
-	spin_unlock(&pblk->trans_lock);
+	pblk_line_refs_put_flush(&refs, pblk_line_put);
 }
 
 static void pblk_queue_resubmit(struct pblk *pblk, struct pblk_c_ctx *c_ctx)
@@ -278,11 +369,7 @@ static void pblk_submit_rec(struct work_struct *work)
 	pblk_queue_resubmit(pblk, c_ctx);
 
 	pblk_up_rq(pblk, rqd->ppa_list, rqd->nr_ppas, c_ctx->lun_bitmap);
-	if (c_ctx->nr_padded)
-		pblk_bio_free_pages(pblk, rqd->bio, c_ctx->nr_valid,
-							c_ctx->nr_padded);
-	bio_put(rqd->bio);
-	pblk_free_rqd(pblk, rqd, PBLK_WRITE);
+	pblk_w_rqd_put(pblk, rqd);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
 	mempool_free(recovery, pblk->rec_pool);
 #else
@@ -314,6 +401,29 @@ static void pblk_end_w_fail(struct pblk *pblk, struct nvm_rq *rqd)
 	queue_work(pblk->close_wq, &recovery->ws_rec);
 }
 
+/*
+ * Moving zero-copy entries to their device mapping takes the l2p lock, which
+ * is not irq safe, and filling the read cache copies every sector. Finish
+ * these writes from process context.
+ */
+static void pblk_end_w_ws(struct work_struct *work)
+{
+	struct pblk_c_ctx *c_ctx = container_of(work, struct pblk_c_ctx,
+									ws_end);
+	struct nvm_rq *rqd = nvm_rq_from_c_ctx(c_ctx);
+	struct pblk *pblk = rqd->private;
+
+	if (c_ctx->nr_zc)
+		pblk_rb_zc_release(&pblk->rwb, c_ctx->sentry, c_ctx->nr_valid);
+
+	if (pblk_rb_fills_rcache(&pblk->rwb))
+		pblk_rb_fill_rcache(&pblk->rwb, c_ctx->sentry,
+							c_ctx->nr_valid);
+
+	pblk_complete_write(pblk, rqd, c_ctx);
+	atomic_dec(&pblk->inflight_io);
+}
+
 static void pblk_end_io_write(struct nvm_rq *rqd)
 {
 	struct pblk *pblk = rqd->private;
@@ -332,6 +442,12 @@ static void pblk_end_io_write(struct nvm_rq *rqd)
 #endif
 #endif
 
+	if (c_ctx->nr_zc || pblk_rb_fills_rcache(&pblk->rwb)) {
+		INIT_WORK(&c_ctx->ws_end, pblk_end_w_ws);
+		queue_work(pblk->w_end_wq, &c_ctx->ws_end);
+		return;
+	}
+
 	pblk_complete_write(pblk, rqd, c_ctx);
 	atomic_dec(&pblk->inflight_io);
 }
@@ -376,10 +492,13 @@ static int pblk_alloc_w_rq(struct pblk *pblk, struct nvm_rq *rqd,
 	rqd->private = pblk;
 	rqd->end_io = end_io;
 
-	rqd->meta_list = pblk_dev_dma_alloc(dev->parent, GFP_KERNEL,
+	/* Pre-built requests come with their own lists */
+	if (!rqd->meta_list) {
+		rqd->meta_list = pblk_dev_dma_alloc(dev->parent, GFP_KERNEL,
 							&rqd->dma_meta_list);
-	if (!rqd->meta_list)
-		return -ENOMEM;
+		if (!rqd->meta_list)
+			return -ENOMEM;
+	}
 
 	rqd->ppa_list = rqd->meta_list + pblk_dma_meta_size;
 	rqd->dma_ppa_list = rqd->dma_meta_list + pblk_dma_meta_size;
@@ -394,38 +513,82 @@ static int pblk_setup_w_rq(struct pblk *pblk, struct nvm_rq *rqd,
 	struct pblk_line *e_line = pblk_line_get_erase(pblk);
 	struct pblk_c_ctx *c_ctx = nvm_rq_to_pdu(rqd);
 	//bookmark: 写的长度由c_ctx决定
-	unsigned int valid = c_ctx->nr_valid;
+	unsigned int valid = c_ctx->nr_valid - c_ctx->nr_skipped;
 	unsigned int padded = c_ctx->nr_padded;
 	unsigned int nr_secs = valid + padded;
 	unsigned long *lun_bitmap;
 	int ret;
 
-	lun_bitmap = kzalloc(lm->lun_bitmap_len, GFP_KERNEL);
-	if (!lun_bitmap)
-		return -ENOMEM;
-	c_ctx->lun_bitmap = lun_bitmap;
+	if (c_ctx->pre) {
+		lun_bitmap = c_ctx->pre->lun_bitmap;
+		memset(lun_bitmap, 0, lm->lun_bitmap_len);
+	} else {
+		lun_bitmap = kzalloc(pblk_w_lun_ctx_len(pblk), GFP_KERNEL);
+		if (!lun_bitmap)
+			return -ENOMEM;
+	}
 
 	ret = pblk_alloc_w_rq(pblk, rqd, nr_secs, pblk_end_io_write);
 	if (ret) {
-		kfree(lun_bitmap);
+		if (!c_ctx->pre)
+			kfree(lun_bitmap);
 		return ret;
 	}
+	c_ctx->lun_bitmap = lun_bitmap;
+	c_ctx->lun_seq = (void *)lun_bitmap + lm->lun_bitmap_len;
 
-	if (likely(!e_line || !atomic_read(&e_line->left_eblks)))
-		pblk_map_rq(pblk, rqd, c_ctx->sentry, lun_bitmap, valid, 0);
+	/* Only the data line erases its next line on the fly */
+	if (likely(!e_line || !atomic_read(&e_line->left_eblks) ||
+						pblk->l_mg.w_stream))
+		ret = pblk_map_rq(pblk, rqd, c_ctx->sentry, lun_bitmap, valid, 0);
 	else {
-		pblk_map_erase_rq(pblk, rqd, c_ctx->sentry, lun_bitmap, valid, erase_ppa);
+		ret = pblk_map_erase_rq(pblk, rqd, c_ctx->sentry, lun_bitmap, valid, erase_ppa);
 	}
+	if (ret)
+		return ret;
+
+	pblk_seq_rq(pblk, lun_bitmap, c_ctx->lun_seq);
 
 	return 0;
 }
 
+/*
+ * Entries of a failed write the current data line can take in one request. A
+ * resubmission is not trimmed to a stripe: whatever is left over is queued for
+ * the next request instead
+ */
+static unsigned int pblk_calc_secs_to_resubmit(struct pblk *pblk,
+					       struct pblk_line *line,
+					       unsigned int nr_valid)
+{
+	int min = line_get_min_write_pgs(line);
+	int left = READ_ONCE(line->left_msecs);
+	int max = pblk->max_write_pgs;
+
+	left -= left % min;
+	if (left >= min && left < max)
+		max = left;
+	max -= max % min;
+
+	return min_t(unsigned int, nr_valid, max);
+}
+
 static int pblk_calc_secs_to_sync(struct pblk *pblk, unsigned int secs_avail,
 				  unsigned int secs_to_flush)
 {
+	struct pblk_line *line = pblk_line_get_data(pblk);
+	int min = line_get_min_write_pgs(line);
+	int left = READ_ONCE(line->left_msecs);
 	int secs_to_sync;
 
-	secs_to_sync = pblk_calc_secs(pblk, secs_avail, secs_to_flush);
+	secs_to_sync = pblk_calc_secs(pblk, line, secs_avail, secs_to_flush);
+
+	/* A stripe must not run past the end of the data line, since the next
+	 * line can be of a different type (SLC/TLC)
+	 */
+	left -= left % min;
+	if (left >= min && secs_to_sync > left)
+		secs_to_sync = left;
 
 #ifdef CONFIG_NVM_DEBUG
 	if ((!secs_to_sync && secs_to_flush)
@@ -600,10 +763,49 @@ static struct pblk_line *pblk_should_submit_meta_io(struct pblk *pblk,
 	return meta_line;
 }
 
+/*
+ * Submission stage. Requests are queued in the order they were mapped and wait
+ * here for their LUNs, so that a busy LUN only holds back the requests that
+ * use it.
+ */
+static void pblk_submit_w_ws(struct work_struct *work)
+{
+	struct pblk_c_ctx *c_ctx = container_of(work, struct pblk_c_ctx,
+									ws_sub);
+	struct nvm_rq *rqd = nvm_rq_from_c_ctx(c_ctx);
+	struct pblk *pblk = rqd->private;
+	int err;
+
+	pblk_down_rq(pblk, c_ctx->lun_bitmap, c_ctx->lun_seq);
+
+	err = pblk_submit_io(pblk, rqd);
+	if (err) {
+		/* Entries are mapped already. Remap them as a failed write */
+		pr_err("pblk: data I/O submission failed: %d\n", err);
+		rqd->error = NVM_RSP_ERR_FAILWRITE;
+		pblk_end_io_write(rqd);
+	}
+}
+
+void pblk_submit_meta_ws(struct work_struct *work)
+{
+	struct pblk *pblk = container_of(work, struct pblk, w_meta_ws);
+	int err;
+
+	/* Submit metadata write for previous data line */
+	err = pblk_submit_meta_io(pblk, pblk->w_meta_line);
+	if (err)
+		pr_err("pblk: metadata I/O submission failed: %d", err);
+
+	atomic_set(&pblk->w_meta_queued, 0);
+}
+
+/* Mapping stage: runs on the write thread only */
 static int pblk_submit_io_set(struct pblk *pblk, struct nvm_rq *rqd)
 {
+	struct pblk_c_ctx *c_ctx = nvm_rq_to_pdu(rqd);
 	struct ppa_addr erase_ppa;
-	struct pblk_line *meta_line;
+	struct pblk_line *meta_line = NULL;
 	int err;
 
 	pblk_ppa_set_empty(&erase_ppa);
@@ -615,15 +817,16 @@ static int pblk_submit_io_set(struct pblk *pblk, struct nvm_rq *rqd)
 		return NVM_IO_ERR;
 	}
 
-	meta_line = pblk_should_submit_meta_io(pblk, rqd);
+	/* A single metadata write is queued at a time. The next one is chosen
+	 * once it has been submitted
+	 */
+	if (!atomic_read(&pblk->w_meta_queued))
+		meta_line = pblk_should_submit_meta_io(pblk, rqd);
 
 	/* Submit data write for current data line */
 	//print_ppa(&pblk->dev->geo, &rqd->ppa_list[0], "submit_io_set", rqd->nr_ppas);
-	err = pblk_submit_io(pblk, rqd);
-	if (err) {
-		pr_err("pblk: data I/O submission failed: %d\n", err);
-		return NVM_IO_ERR;
-	}
+	INIT_WORK(&c_ctx->ws_sub, pblk_submit_w_ws);
+	queue_work(pblk->w_sub_wq, &c_ctx->ws_sub);
 
 	if (!pblk_ppa_empty(erase_ppa)) {
 		/* Submit erase for next data line */
@@ -640,50 +843,329 @@ static int pblk_submit_io_set(struct pblk *pblk, struct nvm_rq *rqd)
 	}
 
 	if (meta_line) {
-		/* Submit metadata write for previous data line */
-		err = pblk_submit_meta_io(pblk, meta_line);
-		if (err) {
-			pr_err("pblk: metadata I/O submission failed: %d", err);
-			return NVM_IO_ERR;
-		}
+		atomic_set(&pblk->w_meta_queued, 1);
+		pblk->w_meta_line = meta_line;
+		queue_work(pblk->w_sub_wq, &pblk->w_meta_ws);
 	}
 
 	return NVM_IO_OK;
 }
 
-static void pblk_free_write_rqd(struct pblk *pblk, struct nvm_rq *rqd)
+void pblk_write_flush_arrival(struct pblk *pblk)
 {
-	struct pblk_c_ctx *c_ctx = nvm_rq_to_pdu(rqd);
-	struct bio *bio = rqd->bio;
+	u64 max_ns = (u64)READ_ONCE(pblk->flush_window_max) * NSEC_PER_USEC;
+	u64 now = ktime_get_ns();
+	u64 last = atomic64_xchg(&pblk->flush_last_ns, now);
+	u64 avg = READ_ONCE(pblk->flush_avg_ns);
+	u64 delta;
+
+	if (!last || now < last)
+		return;
+
+	/* Clamp idle periods so that the average recovers quickly when a
+	 * burst of sync writes starts
+	 */
+	delta = min(now - last, 2 * max_ns);
+	WRITE_ONCE(pblk->flush_avg_ns, avg - (avg >> 3) + (delta >> 3));
+}
+
+/* Current group-commit window in nsecs. 0 if flushes are too far apart to be
+ * grouped
+ */
+u64 pblk_write_flush_window(struct pblk *pblk)
+{
+	u64 max_ns = (u64)READ_ONCE(pblk->flush_window_max) * NSEC_PER_USEC;
+	u64 avg = READ_ONCE(pblk->flush_avg_ns);
+
+	if (!max_ns || avg > max_ns)
+		return 0;
 
-	if (c_ctx->nr_padded)
-		pblk_bio_free_pages(pblk, bio, c_ctx->nr_valid,
-							c_ctx->nr_padded);
+	return avg;
+}
+
+static void pblk_flush_window_close(struct pblk *pblk, unsigned int pad)
+{
+	if (!pblk->flush_wait_pad)
+		return;
+
+	if (pad < pblk->flush_wait_pad)
+		atomic64_add(pblk->flush_wait_pad - pad, &pblk->flush_pad_saved);
+	pblk->flush_wait_pad = 0;
+}
+
+/*
+ * Instead of padding a write unit as soon as a flush arrives, give other
+ * writers a window to add data to it, so that close flushes share a single
+ * padded write. Only the write thread opens and closes windows. Returns true
+ * if the thread waited and the buffer needs to be checked again.
+ */
+static bool pblk_flush_window_wait(struct pblk *pblk, unsigned int secs_avail,
+				   unsigned int secs_to_flush, int min)
+{
+	u64 window;
+
+	if (!secs_to_flush || secs_avail >= min) {
+		pblk_flush_window_close(pblk, 0);
+		return false;
+	}
+
+	if (!pblk->flush_wait_pad) {
+		window = pblk_write_flush_window(pblk);
+		if (!window)
+			return false;
+
+		pblk->flush_wait_pad = min - secs_avail;
+		pblk->flush_wait_end = ktime_add_ns(ktime_get(), window);
+		atomic64_inc(&pblk->flush_windows);
+	} else if (ktime_after(ktime_get(), pblk->flush_wait_end)) {
+		pblk_flush_window_close(pblk, min - secs_avail);
+		return false;
+	}
+
+	/* Producers kick the write thread once a write unit is full */
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (pblk_rb_read_count(&pblk->rwb) >= min) {
+		__set_current_state(TASK_RUNNING);
+		return true;
+	}
+	schedule_hrtimeout(&pblk->flush_wait_end, HRTIMER_MODE_ABS);
+
+	return true;
+}
+
+/*
+ * Write streams. A request is mapped to the open line of a single stream. A
+ * sector must not go to a line older than the one holding its previous copy,
+ * since recovery replays lines in sequence order and would bring the previous
+ * copy back. The newest open line is always safe.
+ */
+static unsigned int pblk_write_stream_newest(struct pblk *pblk)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_line *line, *newest = l_mg->data_line;
+	unsigned int stream, ret = 0;
+
+	for (stream = 1; stream < PBLK_NR_STREAMS; stream++) {
+		line = l_mg->stream_line[stream];
+		if (line && (!newest || line->seq_nr > newest->seq_nr)) {
+			newest = line;
+			ret = stream;
+		}
+	}
+
+	return ret;
+}
+
+static bool pblk_write_stream_fits(struct pblk *pblk, unsigned int stream,
+				   unsigned int seq_floor)
+{
+	struct pblk_line *line = pblk_stream_line(pblk, stream);
+
+	return line->seq_nr >= seq_floor ||
+				stream == pblk_write_stream_newest(pblk);
+}
+
+static unsigned int pblk_write_stream_of(struct pblk *pblk,
+					 struct pblk_w_ctx *w_ctx)
+{
+	if (w_ctx->stream == PBLK_STREAM_SLC)
+		return PBLK_STREAM_SLC;
+
+	return min(w_ctx->stream, READ_ONCE(pblk->nr_streams) - 1);
+}
+
+/* Whether @w_ctx ends the request being formed. See pblk_rb_read_to_bio */
+bool pblk_write_stream_split(struct pblk *pblk, struct pblk_w_ctx *w_ctx,
+			     bool at_unit)
+{
+	unsigned int stream = pblk->l_mg.w_stream;
+
+	if (!pblk_write_stream_fits(pblk, stream, w_ctx->seq_floor))
+		return true;
+
+	/* Sectors of other streams wait for the next request, unless the
+	 * current one would need padding
+	 */
+	return at_unit && pblk_write_stream_of(pblk, w_ctx) != stream;
+}
+
+/*
+ * Pick the open line the request starting at @pos is mapped to, from the
+ * stream of its first entry. Resubmitted entries go to the newest line.
+ */
+static struct pblk_line *pblk_write_select_line(struct pblk *pblk,
+						unsigned int pos, bool resubmit)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_w_ctx *w_ctx = pblk_rb_w_ctx(&pblk->rwb, pos);
+	struct pblk_line *line;
+	unsigned int stream;
+
+	if (resubmit) {
+		stream = pblk_write_stream_newest(pblk);
+		goto out;
+	}
+
+	wait_event(pblk->rwb.written_wait,
+			READ_ONCE(w_ctx->flags) & PBLK_WRITTEN_DATA);
+
+	stream = pblk_write_stream_of(pblk, w_ctx);
+	if (stream && !l_mg->stream_line[stream]) {
+		l_mg->w_stream = stream;
+		if (!pblk_line_replace_data(pblk))
+			stream = 0;
+	}
+
+	if (!pblk_write_stream_fits(pblk, stream, w_ctx->seq_floor)) {
+		stream = pblk_write_stream_newest(pblk);
+		atomic64_inc(&pblk->stream_fallbacks);
+	}
+
+out:
+	l_mg->w_stream = stream;
+
+	line = pblk_line_get_data(pblk);
+	if (pblk_line_is_full(line)) {
+		struct pblk_line *prev_line = line;
+		//printk("ocssd[%s]: pblk_line(%d) is full\n", __func__, line->id);
+		line = pblk_line_replace_data(pblk);
+
+		/* A full stream line leaves its slot even if no line is free
+		 * to replace it, so it is closed either way
+		 */
+		if (line || stream)
+			pblk_line_close_meta(pblk, prev_line);
+	}
+
+	/* The stream is left without a line, e.g., no SLC line is free. Map
+	 * the request to the newest of the others; the first stream always
+	 * has one
+	 */
+	if (!line && stream) {
+		stream = pblk_write_stream_newest(pblk);
+		atomic64_inc(&pblk->stream_fallbacks);
+		goto out;
+	}
+
+	WARN(line==NULL, "ocssd[%s]: replace_data line=NULL\n", __func__);
+	return line;
+}
+
+/* Sectors in a full stripe for the open line of @stream */
+unsigned int pblk_write_batch_secs(struct pblk *pblk, unsigned int stream)
+{
+	struct pblk_line *line = pblk_stream_line(pblk, stream);
+
+	if (!line)
+		return 0;
+
+	return pblk_calc_secs(pblk, line, pblk->max_write_pgs, 0);
+}
+
+/* Sample the sector arrival rate. Write thread only */
+static void pblk_write_batch_sample(struct pblk *pblk)
+{
+	u64 max_ns = (u64)READ_ONCE(pblk->batch_max_us) * NSEC_PER_USEC;
+	u64 now = ktime_get_ns();
+	u64 secs = atomic64_read(&pblk->user_wa) + atomic64_read(&pblk->gc_wa);
+	u64 delta_ns = now - pblk->batch_last_ns;
+	u64 delta_secs = secs - pblk->batch_last_secs;
+	u64 avg = pblk->batch_avg_ns;
+	u64 sample;
+
+	if (!pblk->batch_last_ns || !delta_ns)
+		goto out;
+
+	/* Clamp idle periods so that the average recovers quickly when a
+	 * stream starts
+	 */
+	sample = min(div64_u64(delta_ns, max_t(u64, delta_secs, 1)), 2 * max_ns);
+	pblk->batch_avg_ns = avg - (avg >> 3) + (sample >> 3);
+
+out:
+	pblk->batch_last_ns = now;
+	pblk->batch_last_secs = secs;
+}
+
+static void pblk_write_batch_close(struct pblk *pblk)
+{
+	pblk->batch_wait_end = 0;
+	WRITE_ONCE(pblk->batch_target, 0);
+}
+
+/*
+ * Decide whether a partial stripe is written now or the write thread waits
+ * for more data. It waits when, at the current arrival rate, the stripe fills
+ * up within batch_max_us; light or sync loads are written right away. Writes
+ * that persist a flush are handled by pblk_flush_window_wait(). Returns true
+ * if the thread waited and the buffer needs to be checked again.
+ */
+static bool pblk_write_batch_wait(struct pblk *pblk, unsigned int secs_avail,
+				  unsigned int secs_to_flush)
+{
+	u64 max_ns = (u64)READ_ONCE(pblk->batch_max_us) * NSEC_PER_USEC;
+	unsigned int target = pblk_write_batch_secs(pblk, pblk->l_mg.w_stream);
+	u64 wait_ns;
+
+	pblk_write_batch_sample(pblk);
+
+	if (secs_to_flush || !max_ns || secs_avail >= target) {
+		pblk_write_batch_close(pblk);
+		return false;
+	}
+
+	if (!pblk->batch_wait_end) {
+		wait_ns = pblk->batch_avg_ns * (target - secs_avail);
+		if (!pblk->batch_avg_ns || wait_ns > max_ns) {
+			atomic64_inc(&pblk->batch_now);
+			return false;
+		}
+
+		/* Leave some slack over the prediction, within the bound */
+		pblk->batch_wait_end = ktime_add_ns(ktime_get(),
+						min(2 * wait_ns, max_ns));
+		WRITE_ONCE(pblk->batch_target, target);
+		atomic64_inc(&pblk->batch_waits);
+	} else if (ktime_after(ktime_get(), pblk->batch_wait_end)) {
+		pblk_write_batch_close(pblk);
+		atomic64_inc(&pblk->batch_timeouts);
+		return false;
+	}
+
+	/* Producers kick the write thread once the stripe is full, and on
+	 * flushes
+	 */
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (pblk_rb_read_count(&pblk->rwb) >= target ||
+				pblk_rb_flush_point_count(&pblk->rwb)) {
+		__set_current_state(TASK_RUNNING);
+		return true;
+	}
+	schedule_hrtimeout(&pblk->batch_wait_end, HRTIMER_MODE_ABS);
+
+	return true;
 }
 
 static int pblk_submit_write(struct pblk *pblk)
 {
-	struct bio *bio;
 	struct nvm_rq *rqd;
-	unsigned int secs_avail, secs_to_sync, secs_to_com;
+	unsigned int secs_avail, secs_to_sync;
 	unsigned int secs_to_flush;
 	unsigned long pos;
 	unsigned int resubmit;
-	struct pblk_line *line = pblk_line_get_data(pblk);
+	struct pblk_c_ctx *c_ctx;
+	struct pblk_line *line;
+	int err;
+
+	/* Requests that are mapped and not completed yet hold a pre-built
+	 * request each, which bounds how far mapping runs ahead of the LUNs
+	 */
+	wait_event(pblk->w_pre_wait, READ_ONCE(pblk->nr_w_pre_free));
 
 	spin_lock(&pblk->resubmit_lock);
 	resubmit = !list_empty(&pblk->resubmit_list);
 	spin_unlock(&pblk->resubmit_lock);
 
-	if (pblk_line_is_full(line)) {
-		struct pblk_line *prev_line = line;
-		//printk("ocssd[%s]: pblk_line(%d) is full\n", __func__, line->id);
-		line = pblk_line_replace_data(pblk);
-		WARN(line==NULL, "ocssd[%s]: replace_data line=NULL\n", __func__);
-		if(line != NULL)
-			pblk_line_close_meta(pblk, prev_line);
-	}
-
 	/* Resubmit failed writes first */
 	if (resubmit) {
 		struct pblk_c_ctx *r_ctx;
@@ -694,14 +1176,39 @@ static int pblk_submit_write(struct pblk *pblk)
 		list_del(&r_ctx->list);
 		spin_unlock(&pblk->resubmit_lock);
 
-		secs_avail = r_ctx->nr_valid;
 		pos = r_ctx->sentry;
+		line = pblk_write_select_line(pblk, pos, true);
+		if (!line) {
+			/* Out of lines; writes are being stopped */
+			spin_lock(&pblk->resubmit_lock);
+			list_add(&r_ctx->list, &pblk->resubmit_list);
+			spin_unlock(&pblk->resubmit_lock);
+			return 1;
+		}
 
-		pblk_prepare_resubmit(pblk, pos, secs_avail);
-		secs_to_sync = pblk_calc_secs_to_sync(pblk, secs_avail, secs_avail);
-		printk("ocssd[%s]: resubmit secs_to_sync=%d\n", __func__, secs_to_sync);
+		/* The sync pointer only moves past entries that made it to the
+		 * media, so every entry of the failed request must be written
+		 * again. Keep the part the line cannot take at the head of the
+		 * list
+		 */
+		secs_avail = pblk_calc_secs_to_resubmit(pblk, line,
+							r_ctx->nr_valid);
+		secs_to_sync = roundup(secs_avail,
+					line_get_min_write_pgs(line));
+
+		if (secs_avail < r_ctx->nr_valid) {
+			r_ctx->sentry = pblk_rb_wrap_pos(&pblk->rwb,
+							 pos + secs_avail);
+			r_ctx->nr_valid -= secs_avail;
+
+			spin_lock(&pblk->resubmit_lock);
+			list_add(&r_ctx->list, &pblk->resubmit_list);
+			spin_unlock(&pblk->resubmit_lock);
+		} else {
+			kfree(r_ctx);
+		}
 
-		kfree(r_ctx);
+		pblk_prepare_resubmit(pblk, pos, secs_avail);
 	} else {
 		/* If there are no sectors in the cache,
 		 * flushes (bios without data) will be cleared on
@@ -713,42 +1220,72 @@ static int pblk_submit_write(struct pblk *pblk)
 			return 1;
 		}
 
+		pos = pblk_rb_read_pos(&pblk->rwb);
+		line = pblk_write_select_line(pblk, pos, false);
+		if (!line)
+			return 1;
+
 		//bookmark: 此处时强制补dummy
 		secs_to_flush = pblk_rb_flush_point_count(&pblk->rwb);
 		if (!secs_to_flush && secs_avail < line_get_min_write_pgs(line))
 			return 1;
 
+		if (pblk_flush_window_wait(pblk, secs_avail, secs_to_flush,
+					line_get_min_write_pgs(line)))
+			return 0;
+
+		if (pblk_write_batch_wait(pblk, secs_avail, secs_to_flush))
+			return 0;
+
 		secs_to_sync = pblk_calc_secs_to_sync(pblk, secs_avail, secs_to_flush);
+
+		/* Rather than padding, relocate sectors GC has queued. GC data
+		 * is cold, so it never goes to the SLC stream
+		 */
+		if (secs_to_sync > secs_avail &&
+				pblk->l_mg.w_stream != PBLK_STREAM_SLC &&
+				pblk_gc_fill_pad(pblk, secs_to_sync - secs_avail)) {
+			secs_avail = pblk_rb_read_count(&pblk->rwb);
+			secs_to_sync = pblk_calc_secs_to_sync(pblk, secs_avail,
+								secs_to_flush);
+		}
 		if (secs_to_sync > pblk->max_write_pgs) {
 			printk("pblk-error: bad buffer sync calculation\n");
 			return 1;
 		}
 
-		secs_to_com = (secs_to_sync > secs_avail) ?  secs_avail : secs_to_sync;
-		pos = pblk_rb_read_commit(&pblk->rwb, secs_to_com);
+		/* Entries are committed once pblk_rb_read_to_bio() knows how
+		 * many it consumed, since stale ones are skipped
+		 */
 	}
 
-	bio = bio_alloc(GFP_KERNEL, secs_to_sync);
-
-	bio->bi_iter.bi_sector = 0; /* internal bio */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-	bio->bi_rw |= REQ_WRITE;
-#else
-	bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
-#endif
-
-	rqd = pblk_alloc_rqd(pblk, PBLK_WRITE);
-	rqd->bio = bio;
+	rqd = pblk_w_rqd_get(pblk, secs_to_sync);
+	c_ctx = nvm_rq_to_pdu(rqd);
 
 	//bookmark: 决定要写多少数据
 	//printk("ocssd[%s]: ring_pos=%ld, secs_avail=%d, secs_to_flush=%d, secs_to_sync=%d\n", __func__, pos, secs_avail, secs_to_flush, secs_to_sync);
-	if (pblk_rb_read_to_bio(&pblk->rwb, rqd, pos, secs_to_sync, secs_avail)) {
+	err = pblk_rb_read_to_bio(&pblk->rwb, rqd, pos, secs_to_sync,
+							secs_avail, !resubmit);
+	if (!resubmit)
+		pblk_rb_read_commit(&pblk->rwb, c_ctx->nr_valid);
+	if (err) {
 		pr_err("pblk: corrupted write bio\n");
-		goto fail_put_bio;
+		goto fail_put_rqd;
+	}
+
+	/* All entries were overwritten while on the buffer */
+	if (c_ctx->nr_valid == c_ctx->nr_skipped && !c_ctx->nr_padded) {
+		pblk_complete_write(pblk, rqd, c_ctx);
+		return 0;
 	}
 
 	if (pblk_submit_io_set(pblk, rqd))
-		goto fail_free_bio;
+		goto fail_put_rqd;
+
+	atomic64_inc(&pblk->batch_reqs);
+	atomic64_add(secs_to_sync, &pblk->batch_secs);
+	if (secs_to_sync >= pblk_write_batch_secs(pblk, pblk->l_mg.w_stream))
+		atomic64_inc(&pblk->batch_full);
 
 #ifdef CONFIG_NVM_DEBUG
 	atomic_long_add(secs_to_sync, &pblk->sub_writes);
@@ -756,11 +1293,8 @@ static int pblk_submit_write(struct pblk *pblk)
 
 	return 0;
 
-fail_free_bio:
-	pblk_free_write_rqd(pblk, rqd);
-fail_put_bio:
-	bio_put(bio);
-	pblk_free_rqd(pblk, rqd, PBLK_WRITE);
+fail_put_rqd:
+	pblk_w_rqd_put(pblk, rqd);
 
 	return 1;
 }
@@ -29,6 +29,8 @@
 #include <linux/crc32.h>
 #include <linux/uuid.h>
 #include <linux/version.h>
+#include <linux/prefetch.h>
+#include <linux/shrinker.h>
 #include "lightnvm.h"
 
 /* Run only GC if less than 1/X blocks are free */
@@ -47,11 +49,27 @@
 
 #define PBLK_COMMAND_TIMEOUT_MS 30000
 
+/* Default upper bound of the group-commit window for flushes */
+#define PBLK_FLUSH_WINDOW_US (1000)
+
+/* Default upper bound of the wait for a full stripe under streaming load */
+#define PBLK_BATCH_WAIT_US (200)
+
+/* L2P updates of synced entries are done in batches under trans_lock. The
+ * batch bounds the lock hold time seen by readers; entries are prefetched a
+ * few sectors ahead
+ */
+#define PBLK_L2P_BATCH (64)
+#define PBLK_L2P_PREFETCH (8)
+
 /* Max 512 LUNs per device */
 #define PBLK_MAX_LUNS_BITMAP (4)
 
 #define NR_PHY_IN_LOG (PBLK_EXPOSED_PAGE_SIZE / PBLK_SECTOR)
 
+/* Flushes tracked separately on the write buffer. Must be a power of two */
+#define PBLK_MAX_FLUSH_POINTS (32)
+
 /* Static pool sizes */
 #define PBLK_GEN_WS_POOL_SIZE (2)
 
@@ -86,6 +104,8 @@ enum {
 	PBLK_WRITTEN_DATA	= 1 << 3,
 	PBLK_SUBMITTED_ENTRY	= 1 << 4,
 	PBLK_WRITABLE_ENTRY	= 1 << 5,
+	PBLK_ZC_ENTRY		= 1 << 6,	/* Data lives on the user bio */
+	PBLK_SKIPPED_ENTRY	= 1 << 7,	/* Overwritten, not programmed */
 };
 
 enum {
@@ -117,12 +137,33 @@ enum {
 
 /* write buffer completion context */
 struct pblk_c_ctx {
-	struct list_head list;		/* Head for out-of-order completion */
+	struct list_head list;		/* Head for resubmission */
 
 	unsigned long *lun_bitmap;	/* Luns used on current request */
+	unsigned int *lun_seq;		/* Ticket on each lun in lun_bitmap */
 	unsigned int sentry;
 	unsigned int nr_valid;
 	unsigned int nr_padded;
+	unsigned int nr_skipped;	/* Stale entries left out of the bio */
+	unsigned int nr_zc;		/* Entries pointing to user pages */
+
+	struct work_struct ws_sub;	/* Submission to the device */
+	struct work_struct ws_end;	/* Completion from process context */
+	struct pblk_w_prealloc *pre;	/* Pre-built request, if any */
+};
+
+/* Write request built once and reused, so that the write path does not go
+ * to the allocators on every submission
+ */
+struct pblk_w_prealloc {
+	struct list_head list;
+	struct nvm_rq *rqd;		/* pblk_w_rq_size */
+	struct bio *bio;		/* max_write_pgs vectors */
+	unsigned long *lun_bitmap;	/* Followed by the lun tickets */
+	void *meta_list;		/* Metadata and ppa list */
+	dma_addr_t dma_meta_list;
+	struct page **pad_pages;	/* min_write_pgs padding pages */
+	void *cmd;			/* Device command, NVM_RQ_CMD_SIZE */
 };
 
 /* read context */
@@ -154,12 +195,19 @@ struct pblk_w_ctx {
 	u64 lba;			/* Logic addr. associated with entry */
 	struct ppa_addr ppa;		/* Physic addr. associated with entry */
 	int flags;			/* Write context flags */
+	unsigned int stream;		/* Write stream the entry belongs to */
+	unsigned int seq_floor;		/* Lowest line seq_nr it can go to */
 };
 
 struct pblk_rb_entry {
 	struct ppa_addr cacheline;	/* Cacheline for this entry */
 	void *data;			/* Pointer to data on this entry */
+	void *zc_data;			/* User page backing a zero-copy entry */
 	struct pblk_w_ctx w_ctx;	/* Context for this entry */
+	struct pblk_c_ctx *compl;	/* Request starting on this entry that
+					 * completed out of order. Protected
+					 * by s_lock
+					 */
 	struct list_head index;		/* List head to enable indexes */
 };
 
@@ -174,7 +222,8 @@ struct pblk_rb_pages {
 struct pblk_rb {
 	struct pblk_rb_entry *entries;	/* Ring buffer entries */
 	unsigned int mem;		/* Write offset - points to next
-					 * writable entry in memory
+					 * writable entry in memory. Producers
+					 * move it forward with cmpxchg
 					 */
 	unsigned int subm;		/* Read offset - points to last entry
 					 * that has been submitted to the media
@@ -184,9 +233,28 @@ struct pblk_rb {
 					 * the last submitted entry that has
 					 * been successfully persisted to media
 					 */
-	unsigned int flush_point;	/* Sync point - last entry that must be
-					 * flushed to the media. Used with
-					 * REQ_FLUSH and REQ_FUA
+	unsigned int flush_points[PBLK_MAX_FLUSH_POINTS];
+					/* Sync points - last entry that must be
+					 * flushed to the media for each pending
+					 * REQ_FLUSH and REQ_FUA, in ring order.
+					 * Indexed by flush sequence
+					 */
+	unsigned int flush_head;	/* Sequence of the oldest pending
+					 * flush. Flushes are protected by
+					 * s_lock
+					 */
+	unsigned int flush_tail;	/* Sequence of the next flush */
+	unsigned int frozen;		/* No new entries can be claimed */
+	struct mutex resize_lock;	/* Serializes resizes */
+
+	wait_queue_head_t written_wait;	/* Write thread waiting for a
+					 * producer to finish copying data
+					 */
+	wait_queue_head_t space_wait;	/* Producers waiting for entries or
+					 * budget to be given back
+					 */
+	atomic_t space_events;		/* Bumped every time entries or budget
+					 * might have been given back
 					 */
 	unsigned int l2p_update;	/* l2p update point - next entry for
 					 * which l2p mapping will be updated to
@@ -203,7 +271,9 @@ struct pblk_rb {
 
 	struct list_head pages;		/* List of data pages */
 
-	spinlock_t w_lock;		/* Write lock */
+	spinlock_t w_lock;		/* Write lock - protects l2p_update
+					 * and entries going back to writable
+					 */
 	spinlock_t s_lock;		/* Sync lock */
 
 #ifdef CONFIG_NVM_DEBUG
@@ -216,6 +286,13 @@ struct pblk_rb {
 struct pblk_lun {
 	struct ppa_addr bppa;
 	struct semaphore wr_sem;
+
+	/* Writes take wr_sem in the order they were given a ticket on the LUN,
+	 * so that pages reach the device in order
+	 */
+	atomic_t map_seq;		/* Next ticket */
+	unsigned int sub_seq;		/* Ticket allowed to take wr_sem */
+	wait_queue_head_t seq_wait;
 };
 
 struct pblk_gc_rq {
@@ -261,6 +338,87 @@ struct pblk_gc {
 	spinlock_t r_lock;
 };
 
+#define PBLK_RC_MAX_PAGES (1 << 18)	/* Max. read cache size (1GB) */
+#define PBLK_RA_STREAMS 8	/* Sequential streams tracked for readahead */
+#define PBLK_RA_TRIGGER 2	/* Sequential reads before a stream prefetches */
+#define PBLK_RA_MAX_SECS 4096	/* Max. readahead window */
+#define PBLK_RA_MAX_RQS 16	/* Max. inflight readahead requests */
+
+/* Read cache replacement policies */
+enum {
+	PBLK_RC_LRU = 0,
+	PBLK_RC_2Q,
+	PBLK_RC_NR_POLICIES,
+};
+
+/* Read cache queues. LRU only uses am. 2Q takes new pages on a1in, a FIFO of
+ * a quarter of the cache, and remembers the lbas it evicts on the a1out ghost
+ * list; pages filled again while their lba is on a1out go to am
+ */
+enum {
+	PBLK_RC_A1IN = 0,
+	PBLK_RC_AM,
+	PBLK_RC_A1OUT,
+	PBLK_RC_NR_QUEUES,
+};
+
+/* Read cache fill sources */
+enum {
+	PBLK_RC_SRC_READ = 0,	/* Media reads, on completion */
+	PBLK_RC_SRC_RA,		/* Readahead */
+	PBLK_RC_SRC_WB,		/* Write buffer entries, once on the media */
+	PBLK_RC_NR_SRCS,
+};
+
+#define PBLK_RC_FILL_READ	(1 << PBLK_RC_SRC_READ)
+#define PBLK_RC_FILL_WB		(1 << PBLK_RC_SRC_WB)
+
+struct pblk_ra_stream {
+	sector_t next_lba;	/* Where the next read of the stream starts */
+	sector_t ra_lba;	/* End of what was prefetched for the stream */
+	unsigned int nr_reads;	/* Consecutive reads seen */
+	unsigned long stamp;	/* Last read, in jiffies */
+};
+
+/*
+ * Clean pages read from the media, keyed by lba. An entry also holds the
+ * address it was read from and only serves reads that resolve to that same
+ * address, so entries left behind by a remap are never returned; they are
+ * dropped anyway when the lba is remapped, in order to give the memory back.
+ */
+struct pblk_rcache {
+	spinlock_t lock;		/* Protects the hash, queues and entries */
+	struct hlist_head *hash;
+	unsigned int hash_bits;
+	struct list_head queue[PBLK_RC_NR_QUEUES];	/* Head is newest */
+	unsigned int q_len[PBLK_RC_NR_QUEUES];
+	atomic_t nr_pages;
+	unsigned int max_pages;		/* Pages the cache may hold, 0 disables */
+	unsigned int policy;
+	unsigned int fill;		/* PBLK_RC_FILL_* sources in use */
+	struct shrinker shrinker;
+
+	atomic64_t lookups[PBLK_RC_NR_POLICIES];	/* Media sectors read */
+	atomic64_t hits[PBLK_RC_NR_POLICIES];		/* Served from cache */
+	atomic64_t q_hits[PBLK_RC_NR_QUEUES];	/* Hits per queue, a1out
+						 * counts refills it caught
+						 */
+	atomic64_t fills[PBLK_RC_NR_SRCS];	/* Pages inserted per source */
+	atomic64_t shrunk;			/* Pages given to the shrinker */
+
+	/* Sequential readahead: reads starting where a tracked stream ended
+	 * make it prefetch the next ra_secs sectors into the cache
+	 */
+	spinlock_t ra_lock;
+	struct pblk_ra_stream streams[PBLK_RA_STREAMS];
+	unsigned int ra_secs;		/* Readahead window, 0 disables */
+	atomic_t ra_inflight;		/* Readahead requests on the media */
+	wait_queue_head_t ra_wait;	/* Teardown waiting for them */
+	atomic64_t ra_issued;		/* Sectors prefetched */
+	atomic64_t ra_hits;		/* Prefetched sectors read afterwards */
+	atomic64_t ra_waste;		/* Prefetched sectors dropped unread */
+};
+
 struct pblk_rl {
 	unsigned int high;	/* Upper threshold for rate limiter (free run -
 				 * user I/O rate limiter
@@ -443,6 +601,7 @@ struct pblk_line {
 					 * block line
 					 */
 	unsigned int seq_nr;		/* Unique line sequence number */
+	unsigned int stream;		/* Write stream it was opened for */
 
 	int state;			/* PBLK_LINESTATE_X */
 	int type;			/* PBLK_LINETYPE_X */
@@ -487,7 +646,52 @@ struct pblk_line {
 	spinlock_t lock;		/* Necessary for invalid_bitmap only */
 };
 
-#define PBLK_DATA_LINES 4
+/* Write streams each have an open data line. Stream 0 is the data line, which
+ * has the next line prepared. The others take their lines when needed
+ */
+#define PBLK_MAX_STREAMS 4
+
+/* Small synchronous writes can be placed on an SLC line of their own, which
+ * comes after the hint streams (see pblk_write_stream)
+ */
+#define PBLK_STREAM_SLC PBLK_MAX_STREAMS
+#define PBLK_NR_STREAMS (PBLK_MAX_STREAMS + 1)
+
+/* A sector whose previous copy is still on the write buffer can only go to
+ * the newest open line (see pblk_write_stream_fits)
+ */
+#define PBLK_SEQ_NEWEST UINT_MAX
+
+#define PBLK_DATA_LINES (4 + PBLK_NR_STREAMS - 1)
+
+/* Write classes for sectors without a write hint, from the shortest lived to
+ * the longest lived, as write hints are. Each one is written to the stream of
+ * the same number
+ */
+enum {
+	PBLK_CLASS_HOT = 0,		/* Frequently updated LBA range */
+	PBLK_CLASS_SEQ = 1,		/* Sequential or full stripe write */
+	PBLK_CLASS_COLD = 2,		/* Neither of the above */
+	PBLK_NR_CLASSES,
+};
+
+#define PBLK_CLASS_RANGE_SHIFT 4	/* Updates are counted per 64KB */
+#define PBLK_CLASS_HOT_THRS 4		/* Default updates to be hot */
+#define PBLK_CLASS_NR_SEQ 4		/* Sequential writers followed */
+
+/* Counting Bloom filter of updates per LBA range, halved every 2^cnt_bits
+ * updates so that it follows the workload
+ */
+struct pblk_class {
+	u8 *cnt;			/* Saturating update counters */
+	unsigned int cnt_bits;		/* log2 of the number of counters */
+	unsigned int hot_thrs;		/* Updates to be hot, 0 disables */
+	atomic_t updates;		/* Counter updates */
+	struct work_struct decay_ws;	/* Halves the counters */
+	sector_t seq_end[PBLK_CLASS_NR_SEQ];	/* End of recent writes */
+	atomic_t seq_next;		/* Next seq_end slot to replace */
+	atomic64_t secs[PBLK_NR_CLASSES];	/* Sectors classified */
+};
 
 enum {
 	PBLK_KMALLOC_META = 1,
@@ -528,6 +732,11 @@ struct pblk_line_mgmt {
 	struct pblk_line *log_next;	/* Next FTL log line */
 	struct pblk_line *data_next;	/* Next data line */
 
+	/* Open lines of streams 1.., only touched by the write thread */
+	struct pblk_line *stream_line[PBLK_NR_STREAMS];
+	struct pblk_line *stream_next[PBLK_NR_STREAMS];	/* Being erased */
+	unsigned int w_stream;		/* Stream being mapped by the writer */
+
 	struct list_head emeta_list;	/* Lines queued to schedule emeta */
 
 	__le32 *vsc_list;		/* Valid sector counts for all lines */
@@ -642,6 +851,8 @@ struct pblk {
 	struct pblk_rl rl;
 
 	int sec_per_write;
+	unsigned int max_read_pgs;	/* Max. sectors in a read command */
+	unsigned int zc_min_secs;	/* Min. bio size for zero-copy writes */
 
 	unsigned char instance_uuid[16];
 
@@ -649,6 +860,7 @@ struct pblk {
 	atomic64_t user_wa;		/* Sectors written by user */
 	atomic64_t gc_wa;		/* Sectors written by GC */
 	atomic64_t pad_wa;		/* Padded sectors written */
+	atomic64_t coalesced_wa;	/* Overwritten sectors not written */
 
 	/* Reset values for delta write amplification measurements */
 	u64 user_rst_wa;
@@ -660,6 +872,57 @@ struct pblk {
 	u64 nr_flush_rst;		/* Flushes reset value for pad dist.*/
 	atomic64_t nr_flush;		/* Number of flush/fua I/O */
 
+	/* Group commit: a flush that needs padding waits for more data for up
+	 * to the mean flush inter-arrival time, bounded by flush_window_max
+	 */
+	unsigned int flush_window_max;	/* Max. window in usecs, 0 disables */
+	atomic64_t flush_last_ns;	/* Arrival time of the last flush */
+	u64 flush_avg_ns;		/* Mean flush inter-arrival time */
+	ktime_t flush_wait_end;		/* End of the open window (writer) */
+	unsigned int flush_wait_pad;	/* Padding needed when it opened */
+	atomic64_t flush_windows;	/* Number of windows opened */
+	atomic64_t flush_pad_saved;	/* Padded sectors saved by windows */
+	atomic64_t pad_gc;		/* GC sectors written in place of padding */
+
+	/* Adaptive batching: when sectors arrive fast enough to fill a stripe
+	 * within batch_max_us, the write thread waits for it instead of
+	 * writing what is there. Arrival state is only touched by the writer
+	 */
+	unsigned int batch_max_us;	/* Max. wait in usecs, 0 disables */
+	unsigned int batch_target;	/* Sectors to kick the writer at */
+	u64 batch_last_ns;		/* Time of the last arrival sample */
+	u64 batch_last_secs;		/* Sectors buffered at that time */
+	u64 batch_avg_ns;		/* Mean time between sector arrivals */
+	ktime_t batch_wait_end;		/* End of the current wait, 0 if none */
+	atomic64_t batch_waits;		/* Waits for a fuller stripe */
+	atomic64_t batch_timeouts;	/* Waits that ended on the deadline */
+	atomic64_t batch_now;		/* Partial stripes written right away */
+	atomic64_t batch_full;		/* Requests that filled a stripe */
+	atomic64_t batch_reqs;		/* Requests written from the buffer */
+	atomic64_t batch_secs;		/* Sectors in those requests */
+
+	/* Write streams: sectors are routed to an open line by their write
+	 * lifetime hint. Counters are per stream, 4kb sectors
+	 */
+	unsigned int nr_streams;	/* Streams in use, 1 disables */
+	unsigned int slc_place_secs;	/* Sync writes below go to SLC */
+	atomic64_t stream_user[PBLK_NR_STREAMS];	/* User sectors */
+	atomic64_t stream_gc[PBLK_NR_STREAMS];		/* GC sectors */
+	atomic64_t stream_pad[PBLK_NR_STREAMS];		/* Padded sectors */
+	atomic64_t stream_lines[PBLK_NR_STREAMS];	/* Lines opened */
+	atomic64_t stream_fallbacks;	/* Requests sent to the newest line */
+
+	/* Overwrites of sectors on media, and how many of them were on a line
+	 * of the same stream. Lines reclaimed by GC and sectors it moved out
+	 * of them, by the stream the line was written for
+	 */
+	atomic64_t stream_rw[PBLK_NR_STREAMS];
+	atomic64_t stream_rw_hit[PBLK_NR_STREAMS];
+	atomic64_t stream_gc_lines[PBLK_NR_STREAMS];
+	atomic64_t stream_gc_moved[PBLK_NR_STREAMS];
+
+	struct pblk_class cls;
+
 #ifdef CONFIG_NVM_DEBUG
 	/* Non-persistent debug counters, 4kb sector I/Os */
 	atomic_long_t inflight_writes;	/* Inflight writes (user and gc) */
@@ -674,6 +937,8 @@ struct pblk {
 	atomic_long_t recov_writes;	/* Sectors submitted from recovery */
 	atomic_long_t recov_gc_writes;	/* Sectors submitted from write GC */
 	atomic_long_t recov_gc_reads;	/* Sectors submitted from read GC */
+	atomic_long_t zc_writes;	/* Sectors stored without a copy */
+	atomic_long_t read_splits;	/* Reads split at physical runs */
 #endif
 
 	spinlock_t lock;
@@ -696,11 +961,26 @@ struct pblk {
 	unsigned char *trans_map; //bookmark: l2p map
 	spinlock_t trans_lock;
 
-	struct list_head compl_list;
+	unsigned int compl_queued;	/* Requests completed out of order,
+					 * protected by rwb.s_lock
+					 */
 
 	spinlock_t resubmit_lock;	 /* Resubmit list lock */
 	struct list_head resubmit_list; /* Resubmit list for failed writes*/
 
+	/* Pre-built write requests, one per LUN and one for the request being
+	 * formed. Taken by the write thread and returned on completion, so they
+	 * also bound the requests mapped and not yet completed
+	 */
+	struct pblk_w_prealloc *w_pre;
+	unsigned int nr_w_pre;
+	unsigned int nr_w_pre_free;	/* Protected by w_pre_lock */
+	spinlock_t w_pre_lock;
+	wait_queue_head_t w_pre_wait;
+	struct list_head w_pre_list;
+	atomic64_t w_pre_hits;		/* Requests taken from the pool */
+	atomic64_t w_pre_misses;	/* Requests allocated on the spot */
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
 	mempool_t *page_bio_pool;
 	mempool_t *gen_ws_pool;
@@ -720,10 +1000,20 @@ struct pblk {
 	struct workqueue_struct *close_wq;
 	struct workqueue_struct *bb_wq;
 	struct workqueue_struct *r_end_wq;
+	struct workqueue_struct *w_end_wq;
+	struct workqueue_struct *w_sub_wq;
+
+	/* Metadata writes are issued one at a time by w_meta_ws, so that a busy
+	 * LUN does not stall the write thread
+	 */
+	struct work_struct w_meta_ws;
+	struct pblk_line *w_meta_line;
+	atomic_t w_meta_queued;
 
 	struct timer_list wtimer;
 
 	struct pblk_gc gc;
+	struct pblk_rcache rc;
 };
 
 struct pblk_line_ws {
@@ -779,18 +1069,29 @@ int pblk_rb_may_write_gc(struct pblk_rb *rb, unsigned int nr_entries,
 			 unsigned int *pos);
 void pblk_rb_write_entry_user(struct pblk_rb *rb, void *data,
 			      struct pblk_w_ctx w_ctx, unsigned int pos);
-void pblk_rb_write_entry_gc(struct pblk_rb *rb, void *data,
-			    struct pblk_w_ctx w_ctx, struct pblk_line *line,
-			    u64 paddr, unsigned int pos);
+unsigned int pblk_rb_write_entries_gc(struct pblk_rb *rb,
+				      struct pblk_gc_rq *gc_rq,
+				      struct pblk_w_ctx w_ctx, unsigned int pos);
+void pblk_rb_write_entry_zc(struct pblk_rb *rb, void *data,
+			    struct pblk_w_ctx w_ctx, unsigned int pos);
+void pblk_rb_hold_bio(struct pblk_rb *rb, struct bio *bio, unsigned int pos);
+void pblk_rb_zc_release(struct pblk_rb *rb, unsigned int pos,
+			unsigned int nr_entries);
+bool pblk_rb_fills_rcache(struct pblk_rb *rb);
+void pblk_rb_fill_rcache(struct pblk_rb *rb, unsigned int pos,
+			 unsigned int nr_entries);
 struct pblk_w_ctx *pblk_rb_w_ctx(struct pblk_rb *rb, unsigned int pos);
+void pblk_rb_compl_queue(struct pblk_rb *rb, struct pblk_c_ctx *c_ctx);
+struct pblk_c_ctx *pblk_rb_compl_pop(struct pblk_rb *rb, unsigned int pos);
 void pblk_rb_flush(struct pblk_rb *rb);
 
 void pblk_rb_sync_l2p(struct pblk_rb *rb);
 unsigned int pblk_rb_read_to_bio(struct pblk_rb *rb, struct nvm_rq *rqd,
 				 unsigned int pos, unsigned int nr_entries,
-				 unsigned int count);
+				 unsigned int count, bool split);
 int pblk_rb_copy_to_bio(struct pblk_rb *rb, struct bio *bio, sector_t lba,
 			struct ppa_addr ppa, int bio_iter, bool advanced_bio);
+unsigned int pblk_rb_read_pos(struct pblk_rb *rb);
 unsigned int pblk_rb_read_commit(struct pblk_rb *rb, unsigned int entries);
 
 unsigned int pblk_rb_sync_init(struct pblk_rb *rb, unsigned long *flags);
@@ -807,6 +1108,10 @@ unsigned int pblk_rb_wrap_pos(struct pblk_rb *rb, unsigned int pos);
 int pblk_rb_tear_down_check(struct pblk_rb *rb);
 int pblk_rb_pos_oob(struct pblk_rb *rb, u64 pos);
 void pblk_rb_data_free(struct pblk_rb *rb);
+int pblk_rb_resize(struct pblk_rb *rb, unsigned int nr_entries);
+unsigned int pblk_rb_space_event(struct pblk_rb *rb);
+void pblk_rb_wait_space(struct pblk_rb *rb, unsigned int event);
+void pblk_rb_wake_producers(struct pblk_rb *rb);
 ssize_t pblk_rb_sysfs(struct pblk_rb *rb, char *buf);
 
 /*
@@ -836,11 +1141,13 @@ struct pblk_line *pblk_line_replace_data(struct pblk *pblk);
 int pblk_line_recov_alloc(struct pblk *pblk, struct pblk_line *line);
 void pblk_line_recov_close(struct pblk *pblk, struct pblk_line *line);
 struct pblk_line *pblk_line_get_data(struct pblk *pblk);
+struct pblk_line *pblk_stream_line(struct pblk *pblk, unsigned int stream);
 struct pblk_line *pblk_line_get_erase(struct pblk *pblk);
 int pblk_line_erase(struct pblk *pblk, struct pblk_line *line);
 int pblk_line_is_full(struct pblk_line *line);
 void pblk_line_free(struct pblk_line *line);
 void pblk_line_close_meta(struct pblk *pblk, struct pblk_line *line);
+void pblk_line_close_meta_sync(struct pblk *pblk);
 void pblk_line_close(struct pblk *pblk, struct pblk_line *line);
 void pblk_line_close_ws(struct work_struct *work);
 void pblk_pipeline_stop(struct pblk *pblk);
@@ -861,12 +1168,14 @@ u64 pblk_lookup_page(struct pblk *pblk, struct pblk_line *line);
 void pblk_dealloc_page(struct pblk *pblk, struct pblk_line *line, int nr_secs);
 u64 pblk_alloc_page(struct pblk *pblk, struct pblk_line *line, int nr_secs);
 u64 __pblk_alloc_page(struct pblk *pblk, struct pblk_line *line, int nr_secs);
-int pblk_calc_secs(struct pblk *pblk, unsigned long secs_avail,
-		   unsigned long secs_to_flush);
+int pblk_calc_secs(struct pblk *pblk, struct pblk_line *line,
+		   unsigned long secs_avail, unsigned long secs_to_flush);
 int pblk_calc_secs_line(struct pblk *pblk, unsigned long secs_avail, unsigned long secs_to_flush, int min_write_pgs);
 void pblk_up_page(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas);
-void pblk_down_rq(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas,
-		  unsigned long *lun_bitmap);
+void pblk_seq_rq(struct pblk *pblk, unsigned long *lun_bitmap,
+		 unsigned int *lun_seq);
+void pblk_down_rq(struct pblk *pblk, unsigned long *lun_bitmap,
+		  unsigned int *lun_seq);
 void pblk_down_page(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas);
 void pblk_up_rq(struct pblk *pblk, struct ppa_addr *ppa_list, int nr_ppas,
 		unsigned long *lun_bitmap);
@@ -878,17 +1187,18 @@ void pblk_map_invalidate(struct pblk *pblk, struct ppa_addr ppa);
 void __pblk_map_invalidate(struct pblk *pblk, struct pblk_line *line,
 			   u64 paddr);
 void pblk_update_map(struct pblk *pblk, sector_t lba, struct ppa_addr ppa);
-void pblk_update_map_cache(struct pblk *pblk, sector_t lba,
-			   struct ppa_addr ppa);
-void pblk_update_map_dev(struct pblk *pblk, sector_t lba,
-			 struct ppa_addr ppa, struct ppa_addr entry_line);
-int pblk_update_map_gc(struct pblk *pblk, sector_t lba, struct ppa_addr ppa,
-		       struct pblk_line *gc_line, u64 paddr);
+unsigned int pblk_update_map_cache(struct pblk *pblk, sector_t lba,
+				   struct ppa_addr ppa, unsigned int stream);
+void __pblk_update_map_dev(struct pblk *pblk, sector_t lba,
+			   struct ppa_addr ppa, struct ppa_addr entry_line);
+int __pblk_update_map_gc(struct pblk *pblk, sector_t lba, struct ppa_addr ppa,
+			 struct pblk_line *gc_line, u64 paddr);
 void pblk_lookup_l2p_rand(struct pblk *pblk, struct ppa_addr *ppas,
 			  u64 *lba_list, int nr_secs);
 void pblk_lookup_l2p_seq(struct pblk *pblk, struct ppa_addr *ppas,
 			 sector_t blba, int nr_secs);
 int pblk_get_min_write_pgs(struct pblk *pblk);
+int pblk_stream_min_write_pgs(struct pblk *pblk, unsigned int stream);
 int line_get_min_write_pgs(struct pblk_line *line);
 bool pblk_line_is_slc(struct pblk *pblk, int line_id);
 bool line_is_slc(struct pblk_line *line);
@@ -899,16 +1209,19 @@ bool line_is_slc(struct pblk_line *line);
 int pblk_write_to_cache(struct pblk *pblk, struct bio *bio,
 			unsigned long flags);
 int pblk_write_gc_to_cache(struct pblk *pblk, struct pblk_gc_rq *gc_rq);
+int pblk_write_gc_to_pad(struct pblk *pblk, struct pblk_gc_rq *gc_rq);
+int pblk_class_init(struct pblk *pblk);
+void pblk_class_free(struct pblk *pblk);
 
 /*
  * pblk map
  */
-void pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
-		       unsigned int sentry, unsigned long *lun_bitmap,
-		       unsigned int valid_secs, struct ppa_addr *erase_ppa);
-void pblk_map_rq(struct pblk *pblk, struct nvm_rq *rqd, unsigned int sentry,
-		 unsigned long *lun_bitmap, unsigned int valid_secs,
-		 unsigned int off);
+int pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
+		      unsigned int sentry, unsigned long *lun_bitmap,
+		      unsigned int valid_secs, struct ppa_addr *erase_ppa);
+int pblk_map_rq(struct pblk *pblk, struct nvm_rq *rqd, unsigned int sentry,
+		unsigned long *lun_bitmap, unsigned int valid_secs,
+		unsigned int off);
 
 /*
  * pblk write thread
@@ -921,6 +1234,13 @@ void pblk_write_timer_fn(struct timer_list *t);
 #endif
 void pblk_write_should_kick(struct pblk *pblk);
 void pblk_write_kick(struct pblk *pblk);
+void pblk_write_flush_arrival(struct pblk *pblk);
+u64 pblk_write_flush_window(struct pblk *pblk);
+unsigned int pblk_write_batch_secs(struct pblk *pblk, unsigned int stream);
+int pblk_write_add_pad(struct pblk *pblk, struct nvm_rq *rqd, int nr_pages);
+bool pblk_write_stream_split(struct pblk *pblk, struct pblk_w_ctx *w_ctx,
+			     bool at_unit);
+void pblk_submit_meta_ws(struct work_struct *work);
 
 /*
  * pblk read path
@@ -933,6 +1253,26 @@ extern struct bio_set pblk_bio_set;
 int pblk_submit_read(struct pblk *pblk, struct bio *bio);
 int pblk_submit_read_single(struct pblk *pblk, struct bio *bio);
 int pblk_submit_read_gc(struct pblk *pblk, struct pblk_gc_rq *gc_rq);
+void pblk_read_ahead(struct pblk *pblk, sector_t blba, unsigned int nr_secs);
+
+/*
+ * pblk read cache
+ */
+int pblk_rcache_init(struct pblk *pblk);
+void pblk_rcache_free(struct pblk *pblk);
+bool pblk_rcache_insert(struct pblk *pblk, sector_t lba, struct ppa_addr ppa,
+			struct page *page, int src);
+void pblk_rcache_fill(struct pblk *pblk, sector_t lba, struct ppa_addr ppa,
+		      struct ppa_addr map, void *data, int src);
+bool pblk_rcache_cached(struct pblk *pblk, sector_t lba, struct ppa_addr ppa);
+bool pblk_rcache_read(struct pblk *pblk, struct bio *bio, sector_t lba,
+		      struct ppa_addr ppa, int bio_iter, bool advanced_bio);
+void pblk_rcache_invalidate(struct pblk *pblk, sector_t slba,
+			    unsigned int nr_secs);
+void pblk_rcache_resize(struct pblk *pblk, unsigned int max_pages);
+void pblk_rcache_set_policy(struct pblk *pblk, unsigned int policy);
+const char *pblk_rcache_policy_name(unsigned int policy);
+
 /*
  * pblk recovery
  */
@@ -958,6 +1298,7 @@ void pblk_gc_should_kick(struct pblk *pblk);
 void pblk_gc_slc_start(struct pblk *pblk);
 void pblk_gc_slc_stop(struct pblk *pblk);
 void pblk_gc_free_full_lines(struct pblk *pblk);
+unsigned int pblk_gc_fill_pad(struct pblk *pblk, unsigned int nr_secs);
 void pblk_gc_sysfs_state_show(struct pblk *pblk, int *gc_enabled,
 			      int *gc_active);
 int pblk_gc_sysfs_force(struct pblk *pblk, int force);
@@ -966,17 +1307,17 @@ int pblk_gc_sysfs_force(struct pblk *pblk, int force);
  * pblk rate limiter
  */
 void pblk_rl_init(struct pblk_rl *rl, int budget);
+void pblk_rl_resize(struct pblk_rl *rl, int budget);
 void pblk_rl_free(struct pblk_rl *rl);
 void pblk_rl_update_rates(struct pblk_rl *rl);
 void pblk_rl_update_slc_rates(struct pblk_rl *rl);
 int pblk_rl_high_thrs(struct pblk_rl *rl);
 unsigned long pblk_rl_nr_free_blks(struct pblk_rl *rl);
 unsigned long pblk_rl_nr_user_free_blks(struct pblk_rl *rl);
-int pblk_rl_user_may_insert(struct pblk_rl *rl, int nr_entries);
+int pblk_rl_user_reserve(struct pblk_rl *rl, int nr_entries);
 void pblk_rl_inserted(struct pblk_rl *rl, int nr_entries);
 void pblk_rl_user_in(struct pblk_rl *rl, int nr_entries);
-int pblk_rl_gc_may_insert(struct pblk_rl *rl, int nr_entries);
-void pblk_rl_gc_in(struct pblk_rl *rl, int nr_entries);
+int pblk_rl_gc_reserve(struct pblk_rl *rl, int nr_entries);
 void pblk_rl_out(struct pblk_rl *rl, int nr_user, int nr_gc);
 int pblk_rl_max_io(struct pblk_rl *rl);
 void pblk_rl_free_lines_inc(struct pblk_rl *rl, struct pblk_line *line);
@@ -1008,6 +1349,13 @@ static inline void pblk_mfree(void *ptr, int type)
 		vfree(ptr);
 }
 
+/* Size of the lun bitmap of a write request and the tickets that follow it */
+static inline size_t pblk_w_lun_ctx_len(struct pblk *pblk)
+{
+	return pblk->lm.lun_bitmap_len +
+			pblk->dev->geo.all_luns * sizeof(unsigned int);
+}
+
 static inline struct nvm_rq *nvm_rq_from_c_ctx(void *c_ctx)
 {
 	return c_ctx - sizeof(struct nvm_rq);
@@ -1039,6 +1387,75 @@ static inline int pblk_line_vsc(struct pblk_line *line)
 	return le32_to_cpu(*line->vsc);
 }
 
+/*
+ * Line references are held per mapped sector. The sectors of a request mostly
+ * sit on a single line, so references are taken and dropped in batches of
+ * consecutive sectors on the same line (struct pblk_line_refs) instead of one
+ * atomic operation per sector.
+ */
+static inline void pblk_line_ref_get(struct pblk_line *line, unsigned int nr)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+	atomic_add(nr, &line->ref.refcount);
+#else
+	refcount_add(nr, &line->ref.refcount);
+#endif
+}
+
+static inline void pblk_line_ref_put(struct pblk_line *line, unsigned int nr,
+				     void (*release)(struct kref *kref))
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+	kref_sub(&line->ref, nr, release);
+#else
+	if (refcount_sub_and_test(nr, &line->ref.refcount))
+		release(&line->ref);
+#endif
+}
+
+struct pblk_line_refs {
+	struct pblk_line *line;
+	unsigned int nr;
+};
+
+#define PBLK_LINE_REFS_INIT { .line = NULL, .nr = 0 }
+
+static inline void pblk_line_refs_get_flush(struct pblk_line_refs *refs)
+{
+	if (refs->nr)
+		pblk_line_ref_get(refs->line, refs->nr);
+	refs->nr = 0;
+}
+
+static inline void pblk_line_refs_get(struct pblk_line_refs *refs,
+				      struct pblk_line *line)
+{
+	if (refs->line != line) {
+		pblk_line_refs_get_flush(refs);
+		refs->line = line;
+	}
+	refs->nr++;
+}
+
+static inline void pblk_line_refs_put_flush(struct pblk_line_refs *refs,
+				void (*release)(struct kref *kref))
+{
+	if (refs->nr)
+		pblk_line_ref_put(refs->line, refs->nr, release);
+	refs->nr = 0;
+}
+
+static inline void pblk_line_refs_put(struct pblk_line_refs *refs,
+				      struct pblk_line *line,
+				      void (*release)(struct kref *kref))
+{
+	if (refs->line != line) {
+		pblk_line_refs_put_flush(refs, release);
+		refs->line = line;
+	}
+	refs->nr++;
+}
+
 static inline int pblk_pad_distance(struct pblk *pblk)
 {
 	struct nvm_tgt_dev *dev = pblk->dev;
@@ -1290,6 +1707,11 @@ static inline u32 pblk_ppa64_to_ppa32(struct pblk *pblk, struct ppa_addr ppa64)
 	return ppa32;
 }
 
+/*
+ * L2P entries are updated under trans_lock, but read without it: entries are
+ * naturally aligned words, loaded and stored whole. Readers that need the
+ * mapping to stay valid revalidate it (see pblk_lookup_l2p_seq)
+ */
 static inline struct ppa_addr pblk_trans_map_get(struct pblk *pblk,
 								sector_t lba)
 {
@@ -1298,27 +1720,38 @@ static inline struct ppa_addr pblk_trans_map_get(struct pblk *pblk,
 	if (pblk->addrf_len < 32) {
 		u32 *map = (u32 *)pblk->trans_map;
 
-		ppa = pblk_ppa32_to_ppa64(pblk, map[lba]);
+		ppa = pblk_ppa32_to_ppa64(pblk, READ_ONCE(map[lba]));
 	} else {
-		struct ppa_addr *map = (struct ppa_addr *)pblk->trans_map;
+		u64 *map = (u64 *)pblk->trans_map;
 
-		ppa = map[lba];
+		ppa.ppa = READ_ONCE(map[lba]);
 	}
 
 	return ppa;
 }
 
+static inline void pblk_trans_map_prefetch(struct pblk *pblk, sector_t lba)
+{
+	if (!(lba < pblk->rl.nr_secs))
+		return;
+
+	if (pblk->addrf_len < 32)
+		prefetchw((u32 *)pblk->trans_map + lba);
+	else
+		prefetchw((u64 *)pblk->trans_map + lba);
+}
+
 static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 						struct ppa_addr ppa)
 {
 	if (pblk->addrf_len < 32) {
 		u32 *map = (u32 *)pblk->trans_map;
 
-		map[lba] = pblk_ppa64_to_ppa32(pblk, ppa);
+		WRITE_ONCE(map[lba], pblk_ppa64_to_ppa32(pblk, ppa));
 	} else {
 		u64 *map = (u64 *)pblk->trans_map;
 
-		map[lba] = ppa.ppa;
+		WRITE_ONCE(map[lba], ppa.ppa);
 	}
 }
 
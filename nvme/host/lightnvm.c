@@ -717,6 +717,10 @@ static void nvme_nvm_end_io(struct request *rq, int error)
 {
 	struct nvm_rq *rqd = rq->end_io_data;
 	int meta_id = rqd->meta_id;
+	/* The target can reuse rqd, and its command buffer, as soon as it is
+	 * completed
+	 */
+	bool own_cmd = rq->cmd != rqd->cmd;
 
 //#ifdef ENABLE_ASYNC_META
 	//if(rqd->opcode == NVM_OP_PREAD || rqd->opcode == NVM_OP_PWRITE) {
@@ -747,7 +751,8 @@ static void nvme_nvm_end_io(struct request *rq, int error)
 	pblk_end_io(rqd);//bookmark: async io callback function
 
 	//kfree(nvme_req(rq)->cmd);
-	kfree(rq->cmd);
+	if (own_cmd)
+		kfree(rq->cmd);
 	blk_mq_free_request(rq);
 }
 
@@ -771,10 +776,18 @@ static int nvme_nvm_submit_io(struct nvm_dev *dev, struct nvm_rq *rqd)
 	if (IS_ERR(rq))
 		return -ENOMEM;
 
-	cmd = kzalloc(sizeof(struct nvme_nvm_command), GFP_KERNEL);
-	if (!cmd) {
-		blk_mq_free_request(rq);
-		return -ENOMEM;
+	BUILD_BUG_ON(sizeof(struct nvme_nvm_command) > NVM_RQ_CMD_SIZE);
+
+	/* Targets can provide the command buffer with the request */
+	if (rqd->cmd) {
+		cmd = rqd->cmd;
+		memset(cmd, 0, sizeof(struct nvme_nvm_command));
+	} else {
+		cmd = kzalloc(sizeof(struct nvme_nvm_command), GFP_KERNEL);
+		if (!cmd) {
+			blk_mq_free_request(rq);
+			return -ENOMEM;
+		}
 	}
 
 	rq->cmd_type = REQ_TYPE_DRV_PRIV;